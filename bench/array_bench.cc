@@ -0,0 +1,92 @@
+// g++ -O3 -I ../include -std=c++11 -pthread array_bench.cc -o array_bench
+
+/** @file
+
+    Compare the milou::array sort and unique variants on a host name corpus,
+    with plenty of shared suffixes and duplicates.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one
+    or more contributor license agreements.  See the NOTICE file
+    distributed with this work for additional information
+    regarding copyright ownership.  The ASF licenses this file
+    to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance
+    with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <stdlib.h>
+
+#include "bench.h"
+
+using namespace milou::array;
+using milou::bench::run;
+using milou::bench::sink;
+
+int
+main(int argc, char* argv[])
+{
+  milou::bench::init("array", argc, argv);
+
+  size_t count = argc > 1 ? atol(argv[1]) : 1000000;
+  Strings names = milou::bench::hostnames(count);
+  Strings sorted;
+
+  // Every 4th name shows up twice.
+  for (size_t i = 0; i < count; i += 4)
+    names.push_back(names[i]);
+
+  milou::bench::result("setup", { { "names", static_cast<double>(names.size()) },
+                                   { "threads", static_cast<double>(milou::tasks::Scheduler::instance().size()) } });
+
+  // The copy is part of every measurement, so time that too.
+  run("copy", names.size(), [&]() { Strings v(names); sink += v.size(); }, 1.0);
+  run("sort", names.size(), [&]() { Strings v(names); sort(v); sink += v.size(); }, 1.0);
+  run("parallel_sort", names.size(), [&]() { Strings v(names); parallel_sort(v); sink += v.size(); }, 1.0);
+  run("radix_sort", names.size(), [&]() { Strings v(names); radix_sort(v); sink += v.size(); }, 1.0);
+  run("parallel_radix_sort", names.size(), [&]() { Strings v(names); parallel_radix_sort(v); sink += v.size(); }, 1.0);
+
+  sorted = names;
+  sort(sorted);
+
+  // Sanity check, with and without duplicates, the parallel versions must
+  // give the same result as the serial ones.
+  for (int dups = 1; dups >= 0; --dups) {
+    Strings serial(sorted), parallel(sorted);
+
+    if (!dups)
+      unique(parallel);
+    unique(serial);
+    parallel_unique(parallel);
+    if (serial != parallel) {
+      fprintf(stderr, "parallel_unique() is broken (%s duplicates)\n", dups ? "with" : "without");
+      return 1;
+    }
+  }
+
+  run("unique", sorted.size(), [&]() { Strings v(sorted); unique(v); sink += v.size(); }, 1.0);
+  run("parallel_unique", sorted.size(), [&]() { Strings v(sorted); parallel_unique(v); sink += v.size(); }, 1.0);
+}
+
+
+/*
+ local variables:
+ mode: C++
+ indent-tabs-mode: nil
+ c-basic-offset: 2
+ c-comment-only-line-offset: 0
+ c-file-offsets: ((statement-block-intro . +)
+                  (label . 0)
+                  (statement-cont . +)
+                  (innamespace . 0))
+ end:
+*/
@@ -0,0 +1,184 @@
+/** @file
+
+    A tiny timing harness shared by the benchmarks in this directory.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one or more
+    contributor license agreements.  See the NOTICE file distributed with
+    this work for additional information regarding copyright ownership.  The
+    ASF licenses this file to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance with the
+    License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <initializer_list>
+#include <random>
+#include <utility>
+
+#include <milou/string.h>
+#include <milou/array.h>
+
+namespace milou {
+  namespace bench {
+
+    // Keeps the compiler from optimizing away the work being measured.
+    static volatile size_t sink;
+
+    // With --json, every result is one JSON object per line, tagged with the
+    // suite and the --tag=NAME of the build, for comparing runs.
+    struct Options {
+      const char *suite;
+      const char *tag;
+      bool json;
+    };
+
+    inline Options&
+    options()
+    {
+      static Options opts = { "", "", false };
+      return opts;
+    }
+
+    // Takes our options out of argv, leaving the benchmark's own arguments.
+    inline void
+    init(const char *suite, int& argc, char *argv[])
+    {
+      int n = 1;
+
+      options().suite = suite;
+      for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0)
+          options().json = true;
+        else if (strncmp(argv[i], "--tag=", 6) == 0)
+          options().tag = argv[i] + 6;
+        else
+          argv[n++] = argv[i];
+      }
+      argc = n;
+      argv[n] = NULL;
+    }
+
+    inline void
+    _json_string(const char *s)
+    {
+      putchar('"');
+      for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+          putchar('\\');
+        putchar(*s);
+      }
+      putchar('"');
+    }
+
+    // Print a result with any number of named values.
+    inline void
+    result(const char *name, std::initializer_list<std::pair<const char*, double>> values)
+    {
+      if (options().json) {
+        printf("{\"suite\":");
+        _json_string(options().suite);
+        printf(",\"tag\":");
+        _json_string(options().tag);
+        printf(",\"name\":");
+        _json_string(name);
+        for (auto& v : values) {
+          printf(",");
+          _json_string(v.first);
+          printf(":%.6g", v.second);
+        }
+        printf("}\n");
+      } else {
+        printf("%-40s", name);
+        for (auto& v : values)
+          printf(" %s=%.6g", v.first, v.second);
+        printf("\n");
+      }
+      fflush(stdout);
+    }
+
+    // Run f() (which does ops operations per call) until at least min_secs
+    // have passed, and print the time per operation.
+    template <typename F>
+    double
+    run(const char *name, size_t ops, F f, double min_secs = 0.25)
+    {
+      typedef std::chrono::steady_clock Clock;
+      Clock::time_point start = Clock::now();
+      double secs;
+      size_t calls = 0;
+
+      do {
+        f();
+        ++calls;
+        secs = std::chrono::duration<double>(Clock::now() - start).count();
+      } while (secs < min_secs);
+
+      double ns = secs * 1e9 / (calls * ops);
+
+      if (options().json)
+        result(name, { { "ns_per_op", ns }, { "mops", 1e3 / ns }, { "calls", static_cast<double>(calls) } });
+      else
+        printf("%-40s %10.2f ns/op %10.2f Mops/s\n", name, ns, 1e3 / ns);
+      return ns;
+    }
+
+    // A "realistic" corpus of host names, many sharing a domain suffix. All
+    // are valid, labels start with a letter and do not end with a '-'.
+    inline milou::array::Strings
+    hostnames(size_t count, unsigned seed = 4711)
+    {
+      static const char *suffixes[] = { ".example.com", ".cdn.example.com", ".yahoo.com", ".co.uk", ".org", ".net" };
+      std::mt19937 rng(seed);
+      milou::array::Strings names;
+
+      names.reserve(count);
+      for (size_t i = 0; i < count; ++i) {
+        milou::string::String name;
+        size_t labels = 1 + rng() % 3;
+
+        for (size_t l = 0; l < labels; ++l) {
+          size_t len = 2 + rng() % 12;
+
+          if (l > 0)
+            name += '.';
+          for (size_t j = 0; j < len; ++j)
+            name += "abcdefghijklmnopqrstuvwxyz0123456789-"[rng() % (j == 0 ? 26 : j + 1 == len ? 36 : 37)];
+        }
+        name += suffixes[rng() % (sizeof(suffixes) / sizeof(suffixes[0]))];
+        names.push_back(name);
+      }
+
+      return names;
+    }
+
+  } // namespace bench
+} // namespace milou
+
+
+/*
+  local variables:
+  mode: C++
+  indent-tabs-mode: nil
+  c-basic-offset: 2
+  c-comment-only-line-offset: 0
+  c-file-offsets: ((statement-block-intro . +)
+  (label . 0)
+  (statement-cont . +)
+  (innamespace . 0))
+  end:
+*/
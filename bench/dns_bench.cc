@@ -0,0 +1,348 @@
+// g++ -O3 -I ../include -std=c++11 -pthread dns_bench.cc -o dns_bench -lcares
+
+/** @file
+
+    Resolver throughput and tail latency, against a stub DNS server running
+    in this process, with configurable latency, loss and NXDOMAIN rates.
+
+      dns_bench [--json] [--tag=NAME] [--latency=MS] [--jitter=MS]
+                [--loss=FRACTION] [--nxdomain=FRACTION] [count]
+
+    Without any of the server options, a few canned servers are used.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one
+    or more contributor license agreements.  See the NOTICE file
+    distributed with this work for additional information
+    regarding copyright ownership.  The ASF licenses this file
+    to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance
+    with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <queue>
+#include <thread>
+
+#include <milou/dns.h>
+#include <milou/flow.h>
+#include <milou/metrics.h>
+
+#include "bench.h"
+
+using namespace milou::string;
+using milou::array::Strings;
+using milou::bench::sink;
+using milou::metrics::Histogram;
+using milou::metrics::Report;
+
+// c-ares waits 5s before retrying a lost query, which would make the lossy
+// runs take forever.
+const int TIMEOUT_MS = 500;
+
+// How the stub server behaves. Replies are delayed by latency, plus a
+// uniform random [0, jitter), and loss / nxdomain are fractions of queries.
+struct StubConfig {
+  double latency;
+  double jitter;
+  double loss;
+  double nxdomain;
+};
+
+// A UDP DNS server on 127.0.0.1 (on a free port), answering any query with
+// a made up A record, on its own thread.
+class StubServer {
+public:
+  explicit StubServer(const StubConfig& conf)
+    : _conf(conf), _fd(socket(AF_INET, SOCK_DGRAM, 0)), _port(0), _answers(0), _stop(false), _rng(4711)
+  {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (_fd < 0 || bind(_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(_fd, (struct sockaddr*)&addr, &len) < 0) {
+      perror("stub server");
+      exit(1);
+    }
+    _port = ntohs(addr.sin_port);
+
+    // Lots of room, it is the resolver that should be dropping, not us.
+    int size = 4 * 1024 * 1024;
+
+    setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    _thread = std::thread([this]() { _serve(); });
+  }
+
+  ~StubServer()
+  {
+    _stop = true;
+    _thread.join();
+    close(_fd);
+  }
+
+  // For DNSResolver::servers()
+  String address() const { return "127.0.0.1:" + std::to_string(_port); }
+
+private:
+  struct Reply {
+    uint64_t due;
+    std::vector<char> packet;
+    struct sockaddr_in to;
+
+    bool operator<(const Reply& r) const { return due > r.due; } // Earliest first
+  };
+
+  void
+  _serve()
+  {
+    static const unsigned char answer[] = { 0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10 };
+    std::uniform_real_distribution<double> uniform(0, 1);
+    char buf[512];
+
+    while (!_stop) {
+      uint64_t now = milou::metrics::now();
+
+      while (!_delayed.empty() && _delayed.top().due <= now) {
+        const Reply& r = _delayed.top();
+
+        sendto(_fd, &r.packet[0], r.packet.size(), 0, (const struct sockaddr*)&r.to, sizeof(r.to));
+        _delayed.pop();
+      }
+
+      // Wait for a query, or for the next reply to be due.
+      uint64_t wait = _delayed.empty() ? 10000000 : _delayed.top().due - now;
+      struct timeval tv = { static_cast<time_t>(wait / 1000000000), static_cast<suseconds_t>(wait % 1000000000 / 1000) };
+      fd_set readers;
+
+      FD_ZERO(&readers);
+      FD_SET(_fd, &readers);
+      if (select(_fd + 1, &readers, NULL, NULL, &tv) <= 0)
+        continue;
+
+      // Take all the queries there are, before sending anything.
+      while (1) {
+        Reply r;
+        socklen_t len = sizeof(r.to);
+        ssize_t n = recvfrom(_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&r.to, &len);
+        ssize_t q = 12;
+
+        if (n < 0)
+          break;
+        if (n < q)
+          continue;
+        while (q < n && buf[q])
+          q += 1 + static_cast<unsigned char>(buf[q]);
+        q += 5; // The root label, QTYPE and QCLASS
+        if (q > n || uniform(_rng) < _conf.loss)
+          continue;
+
+        bool nx = uniform(_rng) < _conf.nxdomain;
+
+        r.packet.assign(buf, buf + q);
+        r.packet[2] = '\x81'; // QR, RD
+        r.packet[3] = nx ? '\x83' : '\x80'; // RA, and the RCODE
+        r.packet[7] = nx ? 0 : 1; // ANCOUNT
+        r.packet[9] = r.packet[11] = 0; // No NSCOUNT or ARCOUNT
+        if (!nx) {
+          uint32_t a = ++_answers;
+
+          r.packet.insert(r.packet.end(), answer, answer + sizeof(answer));
+          r.packet.push_back(a >> 16);
+          r.packet.push_back(a >> 8);
+          r.packet.push_back(a);
+        }
+        r.due = milou::metrics::now() + static_cast<uint64_t>((_conf.latency + _conf.jitter * uniform(_rng)) * 1e6);
+        _delayed.push(std::move(r));
+      }
+    }
+  }
+
+  StubConfig _conf;
+  int _fd;
+  int _port;
+  uint32_t _answers;
+  std::atomic<bool> _stop;
+  std::mt19937 _rng;
+  std::priority_queue<Reply> _delayed;
+  std::thread _thread;
+};
+
+// What the lookups in one run added to the (all threads) metrics.
+static Histogram::Snapshot
+histogram_delta(const Report& before, const Report& after, const char *name)
+{
+  Histogram::Snapshot d;
+  auto a = after.histograms.find(name), b = before.histograms.find(name);
+
+  if (a == after.histograms.end())
+    return d;
+  for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+    d.buckets[i] = a->second.data.buckets[i] - (b != before.histograms.end() ? b->second.data.buckets[i] : 0);
+    if (d.buckets[i] > 0) {
+      d.count += d.buckets[i];
+      d.min = std::min(d.min, Histogram::lowest(i));
+      d.max = Histogram::lowest(i) + Histogram::width(i) - 1;
+    }
+  }
+  return d;
+}
+
+static double
+counter_delta(const Report& before, const Report& after, const char *name)
+{
+  auto a = after.counters.find(name), b = before.counters.find(name);
+
+  return (a != after.counters.end() ? a->second : 0) - (b != before.counters.end() ? b->second : 0);
+}
+
+template <typename F>
+static void
+measure(const String& name, F lookups)
+{
+  Report before = milou::metrics::Registry::instance().report();
+  uint64_t start = milou::metrics::now();
+
+  lookups();
+
+  double secs = (milou::metrics::now() - start) / 1e9;
+  Report after = milou::metrics::Registry::instance().report();
+  Histogram::Snapshot latency = histogram_delta(before, after, "dns.latency_us");
+  double queries = counter_delta(before, after, "dns.queries");
+
+  milou::bench::result(name.c_str(), {
+      { "lookups", queries },
+      { "lookups_per_sec", queries / secs },
+      { "failed", queries - counter_delta(before, after, "dns.status.success") },
+      { "timeouts", counter_delta(before, after, "dns.timeouts") },
+      { "p50_us", latency.percentile(50) / 1e3 },
+      { "p90_us", latency.percentile(90) / 1e3 },
+      { "p99_us", latency.percentile(99) / 1e3 },
+      { "p999_us", latency.percentile(99.9) / 1e3 },
+      { "max_us", latency.max / 1e3 } });
+}
+
+// One DNSResolver, on this thread.
+static void
+resolver(const String& name, const StubServer& server, const Strings& names, int parallel)
+{
+  measure(name + " parallel=" + std::to_string(parallel), [&]() {
+      milou::dns::DNSResolver res(parallel, [](const milou::dns::DNSResponse& r) { sink += (r.mHostent != NULL); });
+
+      res.timeout(TIMEOUT_MS);
+      res.servers(server.address().c_str());
+      for (auto& n : names)
+        res.queue(n);
+      res.event_loop();
+    });
+}
+
+// A flow, with threads resolvers.
+static void
+flow(const String& name, const StubServer& server, const Strings& names, int threads, int parallel)
+{
+  measure(name + " flow=" + std::to_string(threads) + "x" + std::to_string(parallel), [&]() {
+      milou::flow::Flow flow;
+      auto& in = flow.channel<String>();
+      auto& out = flow.channel<milou::flow::Resolved>();
+      String servers = server.address();
+      auto setup = [&servers](milou::dns::DNSResolver& res) {
+        res.timeout(TIMEOUT_MS);
+        res.servers(servers.c_str());
+      };
+
+      flow.source(in, [&names](milou::flow::Emitter<String>& emit) {
+          for (auto& n : names)
+            emit.emit(n);
+        });
+      flow.worker(in, out, threads, milou::flow::resolve(parallel, false, setup));
+      flow.sink(out, 1, [](milou::flow::Resolved& r) { sink += r.family; });
+      flow.run();
+    });
+}
+
+int
+main(int argc, char* argv[])
+{
+  struct Server {
+    const char *name;
+    StubConfig conf;
+    std::vector<int> parallel;
+  };
+  std::vector<Server> servers = {
+    { "local", { 0, 0, 0, 0 }, { 10, 100, 1000 } },
+    { "lan", { 1, 1, 0, 0.1 }, { 10, 100, 1000 } },
+    { "wan", { 20, 20, 0, 0.1 }, { 100, 1000 } },
+    { "lossy", { 20, 20, 0.01, 0.1 }, { 100, 1000 } },
+  };
+  Server custom = { "custom", { 0, 0, 0, 0 }, { 10, 100, 1000 } };
+  bool is_custom = false;
+  int n = 1;
+
+  milou::bench::init("dns", argc, argv);
+  for (int i = 1; i < argc; ++i) {
+    double *opt = NULL;
+    const char *eq = strchr(argv[i], '=');
+
+    if (strncmp(argv[i], "--latency=", 10) == 0)
+      opt = &custom.conf.latency;
+    else if (strncmp(argv[i], "--jitter=", 9) == 0)
+      opt = &custom.conf.jitter;
+    else if (strncmp(argv[i], "--loss=", 7) == 0)
+      opt = &custom.conf.loss;
+    else if (strncmp(argv[i], "--nxdomain=", 11) == 0)
+      opt = &custom.conf.nxdomain;
+
+    if (opt) {
+      *opt = atof(eq + 1);
+      is_custom = true;
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+  if (is_custom)
+    servers.assign(1, custom);
+
+  size_t count = n > 1 ? atol(argv[1]) : 20000;
+  Strings names = milou::bench::hostnames(count);
+
+  for (auto& s : servers) {
+    StubServer server(s.conf);
+
+    for (int p : s.parallel)
+      resolver(s.name, server, names, p);
+    flow(s.name, server, names, 4, s.parallel.back() / 4);
+  }
+}
+
+
+/*
+ local variables:
+ mode: C++
+ indent-tabs-mode: nil
+ c-basic-offset: 2
+ c-comment-only-line-offset: 0
+ c-file-offsets: ((statement-block-intro . +)
+                  (label . 0)
+                  (statement-cont . +)
+                  (innamespace . 0))
+ end:
+*/
@@ -0,0 +1,108 @@
+// g++ -O3 -I ../include -std=c++11 perl_bench.cc -o perl_bench
+
+/** @file
+
+    Scalar arithmetic and coercions, against the boost::any based my that
+    Scalar replaced.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one
+    or more contributor license agreements.  See the NOTICE file
+    distributed with this work for additional information
+    regarding copyright ownership.  The ASF licenses this file
+    to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance
+    with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <math.h>
+
+#include <boost/any.hpp>
+
+#include <milou/perl.h>
+
+#include "bench.h"
+
+using milou::perl::Scalar;
+using milou::bench::run;
+using milou::bench::sink;
+
+int
+main(int argc, char* argv[])
+{
+  milou::bench::init("perl", argc, argv);
+
+  // Out of range numbers clamp, like Perl's IV, and arithmetic on them
+  // is done in double.
+  struct {
+    Scalar s;
+    int64_t iv;
+    double plus_one;
+  } checks[] = {
+    { "1e30", INT64_MAX, 1e30 },
+    { "-1e30", INT64_MIN, -1e30 },
+    { NAN, 0, NAN },
+    { "99999999999999999999", INT64_MAX, 1e20 },
+    { INT64_MAX, INT64_MAX, 9223372036854775808.0 },
+  };
+
+  for (auto& c : checks) {
+    Scalar sum = c.s + Scalar(1);
+
+    if (c.s.iv() != c.iv || !(sum.nv() == c.plus_one || (isnan(sum.nv()) && isnan(c.plus_one)))) {
+      fprintf(stderr, "Scalar(\"%s\") is broken: iv() %lld, + 1 is %s\n", c.s.str().to_string().c_str(),
+              static_cast<long long>(c.s.iv()), sum.str().to_string().c_str());
+      return 1;
+    }
+  }
+
+  // A script'ish loop: numbers from strings, summed up and printed.
+  milou::array::Strings numbers;
+
+  for (int i = 0; i < 10000; ++i)
+    numbers.push_back(std::to_string(i * 7919 % 100000));
+
+  run("boost::any (atol + to_string)", numbers.size(), [&]() {
+      boost::any total = 0L;
+
+      for (auto& n : numbers) {
+        boost::any v = n;
+
+        total = boost::any_cast<long>(total) + atol(boost::any_cast<const milou::string::String&>(v).c_str());
+      }
+      sink += std::to_string(boost::any_cast<long>(total)).size();
+    });
+  run("Scalar", numbers.size(), [&]() {
+      Scalar total = 0;
+
+      for (auto& n : numbers) {
+        Scalar v = n;
+
+        total = total + v;
+      }
+      sink += total.str().size();
+    });
+}
+
+
+/*
+ local variables:
+ mode: C++
+ indent-tabs-mode: nil
+ c-basic-offset: 2
+ c-comment-only-line-offset: 0
+ c-file-offsets: ((statement-block-intro . +)
+                  (label . 0)
+                  (statement-cont . +)
+                  (innamespace . 0))
+ end:
+*/
@@ -0,0 +1,127 @@
+// g++ -O3 -I ../include -std=c++11 pool_bench.cc -o pool_bench
+
+/** @file
+
+    Allocation of request objects the way DNSResolver does it: up to some
+    number of requests live at a time, and they are released in whatever
+    order the replies come in.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one
+    or more contributor license agreements.  See the NOTICE file
+    distributed with this work for additional information
+    regarding copyright ownership.  The ASF licenses this file
+    to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance
+    with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <functional>
+#include <new>
+
+#include <boost/pool/pool.hpp>
+
+#include <milou/pool.h>
+
+#include "bench.h"
+
+using milou::bench::run;
+using milou::bench::sink;
+
+// About the size and shape of a DNSRequest.
+struct Request {
+  explicit Request(size_t i) : domain("www.example.com"), start(i) { }
+
+  milou::string::String domain;
+  void *resolver;
+  std::function<void ()> callback;
+  uint64_t start;
+};
+
+// Replace a random live request, ops times.
+template <typename Alloc, typename Free>
+static void
+churn(std::vector<Request*>& live, const std::vector<size_t>& victims, Alloc alloc, Free free)
+{
+  for (size_t i = 0; i < victims.size(); ++i) {
+    Request*& r = live[victims[i]];
+
+    sink += r->start;
+    free(r);
+    r = alloc(i);
+  }
+}
+
+int
+main(int argc, char* argv[])
+{
+  milou::bench::init("pool", argc, argv);
+
+  for (size_t parallel : { 10, 100, 1000, 10000 }) {
+    std::mt19937 rng(4711);
+    std::vector<size_t> victims(100000);
+    std::vector<Request*> live(parallel);
+    milou::string::String suffix = " live=" + std::to_string(parallel);
+
+    for (auto& v : victims)
+      v = rng() % parallel;
+
+    {
+      for (size_t i = 0; i < parallel; ++i)
+        live[i] = new Request(i);
+      run(("new / delete" + suffix).c_str(), victims.size(), [&]() {
+          churn(live, victims, [](size_t i) { return new Request(i); }, [](Request *r) { delete r; });
+        });
+      for (auto r : live)
+        delete r;
+    }
+
+    {
+      boost::object_pool<Request> pool;
+
+      for (size_t i = 0; i < parallel; ++i)
+        live[i] = pool.construct(i);
+      run(("boost::object_pool" + suffix).c_str(), victims.size(), [&]() {
+          churn(live, victims, [&pool](size_t i) { return pool.construct(i); }, [&pool](Request *r) { pool.destroy(r); });
+        });
+    }
+
+    {
+      boost::pool<> pool(sizeof(Request));
+
+      for (size_t i = 0; i < parallel; ++i)
+        live[i] = new (pool.malloc()) Request(i);
+      run(("boost::pool (unordered free)" + suffix).c_str(), victims.size(), [&]() {
+          churn(live, victims, [&pool](size_t i) { return new (pool.malloc()) Request(i); },
+                [&pool](Request *r) { r->~Request(); pool.free(r); });
+        });
+      for (auto r : live) {
+        r->~Request();
+        pool.free(r);
+      }
+    }
+  }
+}
+
+
+/*
+ local variables:
+ mode: C++
+ indent-tabs-mode: nil
+ c-basic-offset: 2
+ c-comment-only-line-offset: 0
+ c-file-offsets: ((statement-block-intro . +)
+                  (label . 0)
+                  (statement-cont . +)
+                  (innamespace . 0))
+ end:
+*/
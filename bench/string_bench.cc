@@ -0,0 +1,210 @@
+// g++ -O3 -I ../include -std=c++11 string_bench.cc -o string_bench
+
+/** @file
+
+    Compare the milou::string kernels against the boost::algorithm calls
+    they replace, at every SIMD level the CPU supports, and milou::perl::Regex
+    against std::regex.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one
+    or more contributor license agreements.  See the NOTICE file
+    distributed with this work for additional information
+    regarding copyright ownership.  The ASF licenses this file
+    to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance
+    with the License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <regex>
+
+#include <milou/regex.h>
+
+#include "bench.h"
+
+using namespace milou::string;
+using milou::array::Strings;
+using milou::bench::run;
+using milou::bench::sink;
+
+int
+main(int argc, char* argv[])
+{
+  Strings names = milou::bench::hostnames(100000);
+  Strings lines, records;
+  String blob;
+
+  milou::bench::init("string", argc, argv);
+
+  // Input lines the way getline() hands them to us, plus some CSV'ish records.
+  for (size_t i = 0; i < names.size(); ++i) {
+    lines.push_back(String(i % 4, ' ') + names[i] + (i % 2 ? " \r" : ""));
+    records.push_back(names[i] + "," + names[(i + 1) % names.size()] + ";" + names[(i + 2) % names.size()]);
+    blob += names[i] + '\n';
+  }
+
+  run("boost::trim_right_if (old chomp)", lines.size(), [&]() {
+      for (auto& l : lines) {
+        String s(l);
+
+        boost::algorithm::trim_right_if(s, boost::is_any_of("\r\n"));
+        sink += s.size();
+      }
+    });
+  run("boost::trim", lines.size(), [&]() {
+      for (auto& l : lines) {
+        String s(l);
+
+        boost::algorithm::trim(s);
+        sink += s.size();
+      }
+    });
+  run("boost::to_lower", names.size(), [&]() {
+      for (auto& n : names) {
+        String s(n);
+
+        boost::algorithm::to_lower(s);
+        sink += s.size();
+      }
+    });
+  run("boost::split", records.size(), [&]() {
+      std::vector<String> fields;
+
+      for (auto& r : records) {
+        boost::algorithm::split(fields, r, boost::is_any_of(",;"));
+        sink += fields.size();
+      }
+    });
+  run("std::string::find (per byte)", blob.size(), [&]() { sink += blob.find("zzzz.example.org"); });
+
+  for (int l = simd::detect(); l >= simd::SCALAR; --l) {
+    String label = String("[") + simd::name(static_cast<simd::Level>(l)) + "] ";
+
+    simd::level() = static_cast<simd::Level>(l);
+    run((label + "chomp").c_str(), lines.size(), [&]() {
+        for (auto& l : lines) {
+          String s(l);
+
+          chomp(s);
+          sink += s.size();
+        }
+      });
+    run((label + "trim").c_str(), lines.size(), [&]() {
+        for (auto& l : lines) {
+          String s(l);
+
+          trim(s);
+          sink += s.size();
+        }
+      });
+    run((label + "trim (StringView)").c_str(), lines.size(), [&]() {
+        for (auto& l : lines) {
+          StringView v(l);
+
+          trim(v);
+          sink += v.size();
+        }
+      });
+    run((label + "lower").c_str(), names.size(), [&]() {
+        for (auto& n : names) {
+          String s(n);
+
+          lower(s);
+          sink += s.size();
+        }
+      });
+    run((label + "split_each").c_str(), records.size(), [&]() {
+        for (auto& r : records)
+          split_each(r, ",;", [](StringView f) { sink += f.size(); });
+      });
+    run((label + "find_substr (per byte)").c_str(), blob.size(), [&]() { sink += find_substr(blob, "zzzz.example.org"); });
+  }
+  simd::level() = simd::detect();
+
+  // $ also matches before a final newline, with more pattern after it, in
+  // the DFA (match() without captures), the backtracker and the Pike VM (on
+  // long strings).
+  for (const char *p : { "a$\n", "(a)$\n", "$\n", "a$$" }) {
+    milou::perl::Regex re(p);
+    milou::perl::Match m;
+    String s("a\n"), padded = String(1024 * 1024, 'x') + s;
+
+    if (!re.match(s) || !re.match(s, m) || !re.search(padded, 0, m)) {
+      fprintf(stderr, "Regex(\"%s\") does not match \"a\\n\"\n", p);
+      return 1;
+    }
+  }
+
+  // Match / no match for a literal and an anchored pattern (answered by the
+  // DFA), then with captures.
+  struct {
+    const char *name;
+    const char *pattern;
+    bool captures;
+  } patterns[] = {
+    { "literal", "example", false },
+    { "anchored", "^[a-z0-9.-]+\\.example\\.com$", false },
+    { "captures", "^([a-z][a-z0-9-]*)\\.(.*)$", true },
+  };
+
+  for (auto& p : patterns) {
+    milou::perl::Regex re(p.pattern);
+    milou::perl::Match m;
+    std::regex sre(p.pattern);
+    std::smatch sm;
+
+    run((String("std::regex ") + p.name).c_str(), names.size(), [&]() {
+        for (auto& n : names)
+          sink += p.captures ? std::regex_search(n, sm, sre) : std::regex_search(n, sre);
+      });
+    run((String("Regex ") + p.name).c_str(), names.size(), [&]() {
+        for (auto& n : names)
+          sink += p.captures ? re.match(n, m) : re.match(n);
+      });
+  }
+
+  run("std::regex_replace (global)", blob.size(), [&]() {
+      sink += std::regex_replace(blob, std::regex("\\.example\\.com\n"), ".example.net\n").size();
+    });
+  run("subst (global)", blob.size(), [&]() {
+      String s(blob);
+
+      sink += milou::perl::subst(s, milou::perl::Regex("\\.example\\.com\n"), ".example.net\n", true);
+    });
+
+  // Matches only near the end of a big string, where searches (from each
+  // match on) are short enough for the backtracker. Its bookkeeping has to
+  // be for what is left of the string, or this goes quadratic.
+  String tail(20 * 1024 * 1024, 'x');
+
+  for (int i = 0; i < 1000; ++i)
+    tail += "ab1 ";
+  run("subst (global, matches at the tail)", tail.size(), [&]() {
+      String s(tail);
+
+      sink += milou::perl::subst(s, milou::perl::Regex("a(b)\\d"), "[$1]", true);
+    }, 1.0);
+}
+
+
+/*
+ local variables:
+ mode: C++
+ indent-tabs-mode: nil
+ c-basic-offset: 2
+ c-comment-only-line-offset: 0
+ c-file-offsets: ((statement-block-intro . +)
+                  (label . 0)
+                  (statement-cont . +)
+                  (innamespace . 0))
+ end:
+*/
@@ -1,7 +1,7 @@
-// #!/bin/env milou -lcares
+// #!/bin/env milou -lcares -pthread
 // Implies -std=c++0x with gcc
 
-// /opt/gcc/bin/g++  -g -O3 -pedantic -Wall -L/opt/gcc/lib64 -Wl,-rpath=/opt/gcc/lib64 -I ../include -std=c++11 -lcares genremap.cc
+// /opt/gcc/bin/g++  -g -O3 -pedantic -Wall -L/opt/gcc/lib64 -Wl,-rpath=/opt/gcc/lib64 -I ../include -std=c++11 -pthread -lcares genremap.cc
 
 /** @file
 
@@ -32,50 +32,47 @@
 #include <milou/milou.h>
 
 
-// This gets called everytime we get a response from the DNS processor.
-// It could also be a lambda, or functor.
+// Buffered STDOUT, flushed on exit.
+Writer out;
+
+// This gets called for every lookup, on the writer thread. It could also be
+// a lambda, or functor.
 void
-callback(const DNSResponse &response)
+callback(Resolved &response)
 {
 #if 0
-  String ip = response.ip();
-
-  if (size(ip) > 0)
-    cout << "map http://" << response.mDomain << " http://" << ip << endl;
+  if (response.family)
+    out << "map http://" << response.name << " http://" << response.address() << '\n';
   else
-    cerr << "Failed lookup: " << response.mDomain << endl;
+    cerr << "Failed lookup: " << response.name << endl;
 #endif
 }
 
 int
 main(int argc, char* argv[])
 {
-  DNSResolver res(100, callback);
-  EventLoop loop;
+  LineReader in(argc > 1 ? argv[1] : NULL);
+  Flow flow;
+  auto& lines = flow.channel<String>();
+  auto& names = flow.channel<String>();
+  auto& ips = flow.channel<Resolved>();
 
   // TODO: Collect / move this to some standard startup?
   ios_base::sync_with_stdio(false);
   cout << nounitbuf;
 
-  // Read all the STDIN lines, and add them to be resolved.
-  while (cin) {
-    String line;
-
-    getline(cin, line);
-    chomp(line);
-    trim(line);
-    res.queue(line);
-  }
-
-  // Sort and unique all the resolver requests.
-  res.sort();
-  res.unique();
-
-  //loop.loop(res);
-  res.event_loop();
+  // Read, dedupe, resolve and write all at once, each stage on its own
+  // thread(s). Names are canonicalized as they are read, so that the
+  // dedupe sees every spelling of a name as one, and junk is dropped. The
+  // resolvers then take them as they are.
+  flow.source(lines, read_names(in));
+  flow.stage(lines, names, 1, dedupe<String>());
+  flow.worker(names, ips, 4, resolve_names(100));
+  flow.sink(ips, 1, callback);
+  flow.run();
 }
 
-
+
 /*
  local variables:
  mode: C++
@@ -22,8 +22,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
 #include <vector>
+
 #include <milou/string.h>
+#include <milou/tasks.h>
 
 namespace milou {
   namespace array {
@@ -31,10 +38,10 @@ namespace milou {
     typedef std::vector<milou::string::String> Strings;
 
     // Chomp all strings in an array.
-    Strings&
+    inline Strings&
     chomp(Strings& arr)
     {
-      for (auto s : arr)
+      for (auto& s : arr)
         milou::string::chomp(s);
       return arr;
     }
@@ -84,6 +91,614 @@ namespace milou {
       v->erase(unique(v->begin(), v->end()), v->end());
     }
 
+    // Parallel versions of the above, using the shared tasks::Scheduler.
+    // Arrays smaller than this are not worth splitting up.
+    const size_t PARALLEL_CUTOFF = 16384;
+
+    template <typename It, typename Cmp>
+    void
+    _parallel_sort(It first, It last, Cmp cmp, int depth, milou::tasks::TaskGroup& group)
+    {
+      typedef typename std::iterator_traits<It>::value_type T;
+
+      // Quicksort, with a three way partition (host name lists have plenty of
+      // duplicates), forking off the lower part. Falls back on std::sort()
+      // for small partitions, or if the pivots turn out to be bad.
+      while (last - first > static_cast<ptrdiff_t>(PARALLEL_CUTOFF) && depth-- > 0) {
+        const T& a = *first;
+        const T& b = *(first + (last - first) / 2);
+        const T& c = *(last - 1);
+        const T pivot = cmp(a, b) ? (cmp(b, c) ? b : (cmp(a, c) ? c : a)) : (cmp(a, c) ? a : (cmp(b, c) ? c : b));
+        It lo = std::partition(first, last, [&](const T& x) { return cmp(x, pivot); });
+        It hi = std::partition(lo, last, [&](const T& x) { return !cmp(pivot, x); });
+
+        group.run([=, &group]() { _parallel_sort(first, lo, cmp, depth, group); });
+        first = hi;
+      }
+      std::sort(first, last, cmp);
+    }
+
+    template <typename T, typename Cmp>
+    inline void
+    parallel_sort(std::vector<T>& v, Cmp cmp)
+    {
+      milou::tasks::TaskGroup group;
+      int depth = 0;
+
+      for (size_t n = v.size(); n > 0; n >>= 1)
+        depth += 2;
+      _parallel_sort(v.begin(), v.end(), cmp, depth, group);
+      group.wait();
+    }
+
+    template <typename T>
+    inline void
+    parallel_sort(std::vector<T>& v)
+    {
+      parallel_sort(v, std::less<T>());
+    }
+
+    template <typename T>
+    inline void
+    parallel_sort(std::vector<T> *v)
+    {
+      parallel_sort(*v, std::less<T>());
+    }
+
+    // Unique a sorted array in chunks. Each chunk first skips past the
+    // duplicates of the previous chunk's last element, then the unique
+    // chunks are moved together.
+    template <typename T>
+    inline void
+    parallel_unique(std::vector<T>& v)
+    {
+      milou::tasks::TaskGroup group;
+      size_t chunks = group.scheduler().size() * 4;
+
+      if (v.size() < PARALLEL_CUTOFF || chunks < 2) {
+        unique(v);
+        return;
+      }
+
+      std::vector<size_t> begin(chunks), end(chunks), limit(chunks);
+
+      for (size_t i = 0; i < chunks; ++i) {
+        size_t b = v.size() * i / chunks;
+
+        limit[i] = v.size() * (i + 1) / chunks;
+        while (i > 0 && b < limit[i] && v[b] == v[v.size() * i / chunks - 1])
+          ++b;
+        begin[i] = b;
+      }
+
+      for (size_t i = 0; i < chunks; ++i) {
+        group.run([&v, &begin, &end, &limit, i]() {
+            end[i] = std::unique(v.begin() + begin[i], v.begin() + limit[i]) - v.begin();
+          });
+      }
+      group.wait();
+
+      auto out = v.begin() + end[0];
+
+      // A chunk already in place must not be moved onto itself, that
+      // leaves moved from (e.g. empty) strings behind.
+      for (size_t i = 1; i < chunks; ++i) {
+        if (out == v.begin() + begin[i])
+          out = v.begin() + end[i];
+        else
+          out = std::move(v.begin() + begin[i], v.begin() + end[i], out);
+      }
+      v.erase(out, v.end());
+    }
+
+    template <typename T>
+    inline void
+    parallel_unique(std::vector<T> *v)
+    {
+      parallel_unique(*v);
+    }
+
+    // MSD radix sort (American flag sort) for strings. Each pass buckets on
+    // one byte, so a shared prefix is only looked at once per string, rather
+    // than once per comparison. The ordering is the same as std::sort().
+    inline size_t
+    _radix_key(const milou::string::String& s, size_t depth)
+    {
+      return depth < s.size() ? static_cast<unsigned char>(s[depth]) + 1 : 0;
+    }
+
+    inline void
+    _radix_sort(Strings::iterator first, Strings::iterator last, size_t depth, milou::tasks::TaskGroup *group)
+    {
+      size_t n = last - first;
+      size_t count[257] = { 0 };
+      size_t next[257], end[257];
+
+      // Small buckets, insertion sort on what's left after the common prefix.
+      if (n < 32) {
+        for (auto i = first + 1; i < last; ++i)
+          for (auto j = i; j > first && j->compare(depth, milou::string::String::npos, *(j - 1), depth, milou::string::String::npos) < 0; --j)
+            std::swap(*j, *(j - 1));
+        return;
+      }
+
+      for (auto i = first; i < last; ++i)
+        ++count[_radix_key(*i, depth)];
+
+      next[0] = 0;
+      for (size_t b = 0; b < 257; ++b) {
+        end[b] = next[b] + count[b];
+        if (b < 256)
+          next[b + 1] = end[b];
+      }
+
+      for (size_t b = 0; b < 257; ++b) {
+        while (next[b] < end[b]) {
+          size_t k = _radix_key(first[next[b]], depth);
+
+          if (k == b)
+            ++next[b];
+          else
+            std::swap(first[next[b]], first[next[k]++]);
+        }
+      }
+
+      // Bucket 0 are the strings that ended here, and they are all equal.
+      for (size_t b = 1, start = count[0]; b < 257; start += count[b++]) {
+        if (count[b] < 2)
+          continue;
+
+        auto bfirst = first + start;
+        auto blast = bfirst + count[b];
+
+        if (group && count[b] > PARALLEL_CUTOFF)
+          group->run([=]() { _radix_sort(bfirst, blast, depth + 1, group); });
+        else
+          _radix_sort(bfirst, blast, depth + 1, group);
+      }
+    }
+
+    inline void
+    radix_sort(Strings& v)
+    {
+      _radix_sort(v.begin(), v.end(), 0, NULL);
+    }
+
+    inline void
+    radix_sort(Strings *v)
+    {
+      radix_sort(*v);
+    }
+
+    inline void
+    parallel_radix_sort(Strings& v)
+    {
+      milou::tasks::TaskGroup group;
+
+      _radix_sort(v.begin(), v.end(), 0, &group);
+      group.wait();
+    }
+
+    inline void
+    parallel_radix_sort(Strings *v)
+    {
+      parallel_radix_sort(*v);
+    }
+
+    // Lazy, Perl'ish list pipelines, e.g.
+    //
+    //   String s = from(lines).grep(is_valid).map(lc).uniq().take(100).join(",");
+    //
+    // Nothing runs until a terminal (collect(), join(), each() or count()),
+    // and then all stages run fused, one element at a time. Elements are
+    // passed along by reference, and moved out of from(std::move(v)), so
+    // nothing is copied or allocated except by map() and the terminal. The
+    // exception is uniq() after map() or from(std::move(v)), which has to
+    // keep a copy of the last element, since the original is gone by the
+    // time the next one comes along.
+    //
+    // Each stage is a generator, which pushes elements [b, e) of the source
+    // through its own sink into the next one. A sink returning false stops
+    // the pipeline early. A pipeline can only be run once.
+    template <typename T>
+    struct _SourceGen {
+      typedef T value_type;
+      static const bool stateless = true;
+
+      size_t size() const { return vec->size(); }
+
+      template <typename Sink>
+      bool
+      operator()(Sink& sink, size_t b, size_t e) const
+      {
+        for (; b < e; ++b)
+          if (!sink((*vec)[b]))
+            return false;
+        return true;
+      }
+
+      const std::vector<T> *vec;
+    };
+
+    template <typename T>
+    struct _MoveSourceGen {
+      typedef T value_type;
+      static const bool stateless = true;
+
+      size_t size() const { return vec.size(); }
+
+      template <typename Sink>
+      bool
+      operator()(Sink& sink, size_t b, size_t e) const
+      {
+        for (; b < e; ++b)
+          if (!sink(std::move(vec[b])))
+            return false;
+        return true;
+      }
+
+      mutable std::vector<T> vec;
+    };
+
+    template <typename Sink, typename Pred>
+    struct _GrepSink {
+      template <typename X>
+      bool
+      operator()(X&& x)
+      {
+        return pred(x) ? sink(std::forward<X>(x)) : true;
+      }
+
+      Sink& sink;
+      const Pred& pred;
+    };
+
+    template <typename Prev, typename Pred>
+    struct _GrepGen {
+      typedef typename Prev::value_type value_type;
+      static const bool stateless = Prev::stateless;
+
+      size_t size() const { return prev.size(); }
+
+      template <typename Sink>
+      bool
+      operator()(Sink& sink, size_t b, size_t e) const
+      {
+        _GrepSink<Sink, Pred> s = { sink, pred };
+        return prev(s, b, e);
+      }
+
+      Prev prev;
+      Pred pred;
+    };
+
+    template <typename Sink, typename F>
+    struct _MapSink {
+      template <typename X>
+      bool
+      operator()(X&& x)
+      {
+        return sink(f(std::forward<X>(x)));
+      }
+
+      Sink& sink;
+      const F& f;
+    };
+
+    template <typename Prev, typename F>
+    struct _MapGen {
+      typedef typename std::decay<typename std::result_of<const F&(typename Prev::value_type&&)>::type>::type value_type;
+      static const bool stateless = Prev::stateless;
+
+      size_t size() const { return prev.size(); }
+
+      template <typename Sink>
+      bool
+      operator()(Sink& sink, size_t b, size_t e) const
+      {
+        _MapSink<Sink, F> s = { sink, f };
+        return prev(s, b, e);
+      }
+
+      Prev prev;
+      F f;
+    };
+
+    // Drops adjacent duplicates, same as unique(). Elements passed by
+    // reference are elements of the source, which stay put, so those are
+    // compared in place. Temporaries (from map()) and moved elements have to
+    // be copied.
+    template <typename Sink, typename T>
+    struct _UniqSink {
+      template <typename X>
+      bool
+      operator()(X& x)
+      {
+        if (prev && x == *prev)
+          return true;
+        prev = &x;
+        return sink(x);
+      }
+
+      template <typename X>
+      bool
+      operator()(X&& x)
+      {
+        if (seen && x == last)
+          return true;
+        seen = true;
+        last = x;
+        return sink(std::move(x));
+      }
+
+      Sink& sink;
+      const T *prev;
+      T last;
+      bool seen;
+    };
+
+    template <typename Prev>
+    struct _UniqGen {
+      typedef typename Prev::value_type value_type;
+      static const bool stateless = false;
+
+      size_t size() const { return prev.size(); }
+
+      template <typename Sink>
+      bool
+      operator()(Sink& sink, size_t b, size_t e) const
+      {
+        _UniqSink<Sink, value_type> s = { sink, NULL, value_type(), false };
+        return prev(s, b, e);
+      }
+
+      Prev prev;
+    };
+
+    template <typename Sink>
+    struct _TakeSink {
+      template <typename X>
+      bool
+      operator()(X&& x)
+      {
+        return left > 0 && sink(std::forward<X>(x)) && --left > 0;
+      }
+
+      Sink& sink;
+      size_t left;
+    };
+
+    template <typename Prev>
+    struct _TakeGen {
+      typedef typename Prev::value_type value_type;
+      static const bool stateless = false;
+
+      size_t size() const { return prev.size(); }
+
+      template <typename Sink>
+      bool
+      operator()(Sink& sink, size_t b, size_t e) const
+      {
+        _TakeSink<Sink> s = { sink, n };
+        return n > 0 && prev(s, b, e);
+      }
+
+      Prev prev;
+      size_t n;
+    };
+
+    template <typename T>
+    struct _CollectSink {
+      template <typename X>
+      bool
+      operator()(X&& x)
+      {
+        out.push_back(std::forward<X>(x));
+        return true;
+      }
+
+      std::vector<T>& out;
+    };
+
+    struct _JoinSink {
+      template <typename X>
+      bool
+      operator()(const X& x)
+      {
+        if (count++ > 0)
+          out.append(sep.data(), sep.size());
+        out.append(x.data(), x.size());
+        return true;
+      }
+
+      milou::string::String& out;
+      milou::string::StringView sep;
+      size_t count;
+    };
+
+    template <typename F>
+    struct _EachSink {
+      template <typename X>
+      bool
+      operator()(X&& x)
+      {
+        f(std::forward<X>(x));
+        return true;
+      }
+
+      F& f;
+    };
+
+    template <typename Gen>
+    class Pipeline {
+    public:
+      typedef typename Gen::value_type value_type;
+
+      explicit Pipeline(Gen gen, bool par = false)
+        : _gen(std::move(gen)), _parallel(par)
+      { }
+
+      // Opt-in: run the terminal on the shared tasks::Scheduler, in chunks
+      // of the source. The output order is kept. Since uniq() and take()
+      // depend on what came before, pipelines with those run sequentially.
+      // The grep() and map() functions must then be safe to call concurrently.
+      Pipeline
+      parallel(bool p = true)
+      {
+        return Pipeline(std::move(_gen), p);
+      }
+
+      template <typename Pred>
+      Pipeline<_GrepGen<Gen, Pred>>
+      grep(Pred pred)
+      {
+        _GrepGen<Gen, Pred> g = { std::move(_gen), std::move(pred) };
+        return Pipeline<_GrepGen<Gen, Pred>>(std::move(g), _parallel);
+      }
+
+      template <typename F>
+      Pipeline<_MapGen<Gen, F>>
+      map(F f)
+      {
+        _MapGen<Gen, F> g = { std::move(_gen), std::move(f) };
+        return Pipeline<_MapGen<Gen, F>>(std::move(g), _parallel);
+      }
+
+      Pipeline<_UniqGen<Gen>>
+      uniq()
+      {
+        _UniqGen<Gen> g = { std::move(_gen) };
+        return Pipeline<_UniqGen<Gen>>(std::move(g), _parallel);
+      }
+
+      Pipeline<_TakeGen<Gen>>
+      take(size_t n)
+      {
+        _TakeGen<Gen> g = { std::move(_gen), n };
+        return Pipeline<_TakeGen<Gen>>(std::move(g), _parallel);
+      }
+
+      std::vector<value_type>
+      collect()
+      {
+        std::vector<value_type> out;
+
+        if (_chunks() > 1) {
+          std::vector<std::vector<value_type>> parts(_chunks());
+          size_t total = 0;
+
+          _run_chunks([&parts](size_t i, const Gen& gen, size_t b, size_t e) {
+              _CollectSink<value_type> s = { parts[i] };
+              gen(s, b, e);
+            }, parts.size());
+
+          for (auto& p : parts)
+            total += p.size();
+          out.reserve(total);
+          for (auto& p : parts)
+            std::move(p.begin(), p.end(), std::back_inserter(out));
+        } else {
+          _CollectSink<value_type> s = { out };
+          _gen(s, 0, _gen.size());
+        }
+
+        return out;
+      }
+
+      // Perl's join(), the elements must be String's or StringView's.
+      milou::string::String
+      join(milou::string::StringView sep)
+      {
+        milou::string::String out;
+
+        if (_chunks() > 1) {
+          std::vector<milou::string::String> parts(_chunks());
+          std::vector<size_t> counts(parts.size());
+          size_t joined = 0;
+
+          _run_chunks([&parts, &counts, sep](size_t i, const Gen& gen, size_t b, size_t e) {
+              _JoinSink s = { parts[i], sep, 0 };
+              gen(s, b, e);
+              counts[i] = s.count;
+            }, parts.size());
+
+          for (size_t i = 0; i < parts.size(); ++i) {
+            if (counts[i] == 0)
+              continue;
+            if (joined++ > 0)
+              out.append(sep.data(), sep.size());
+            out += parts[i];
+          }
+        } else {
+          _JoinSink s = { out, sep, 0 };
+          _gen(s, 0, _gen.size());
+        }
+
+        return out;
+      }
+
+      // Call f(element) for each element, always sequentially.
+      template <typename F>
+      void
+      each(F f)
+      {
+        _EachSink<F> s = { f };
+        _gen(s, 0, _gen.size());
+      }
+
+      size_t
+      count()
+      {
+        size_t n = 0;
+
+        each([&n](const value_type&) { ++n; });
+        return n;
+      }
+
+    private:
+      size_t
+      _chunks() const
+      {
+        if (!_parallel || !Gen::stateless)
+          return 1;
+        return std::min(_gen.size(), static_cast<size_t>(milou::tasks::Scheduler::instance().size() * 4));
+      }
+
+      template <typename F>
+      void
+      _run_chunks(F f, size_t chunks)
+      {
+        milou::tasks::TaskGroup group;
+        size_t n = _gen.size();
+        const Gen& gen = _gen;
+
+        for (size_t i = 0; i < chunks; ++i)
+          group.run([&f, &gen, i, n, chunks]() { f(i, gen, n * i / chunks, n * (i + 1) / chunks); });
+        group.wait();
+      }
+
+      Gen _gen;
+      bool _parallel;
+    };
+
+    // Start a pipeline over an array. Pass an rvalue (std::move(v)) to have
+    // the elements moved, rather than copied, into the output.
+    template <typename T>
+    inline Pipeline<_SourceGen<T>>
+    from(const std::vector<T>& v)
+    {
+      _SourceGen<T> g = { &v };
+      return Pipeline<_SourceGen<T>>(g);
+    }
+
+    template <typename T>
+    inline Pipeline<_MoveSourceGen<T>>
+    from(std::vector<T>&& v)
+    {
+      _MoveSourceGen<T> g = { std::move(v) };
+      return Pipeline<_MoveSourceGen<T>>(std::move(g));
+    }
+
   } // namespace array
 } // namespace milou
 
@@ -23,29 +23,242 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <stdint.h>
 
 #include <ares.h>
 #include <netdb.h>
 
 #include <functional>
+#include <unordered_set>
 
 #include <milou/array.h>
 #include <milou/string.h>
 #include <milou/pool.h>
 #include <milou/events.h>
-
-static void
-sock_callback(void *data, ares_socket_t socket_fd, int readable, int writable)
-{
-  printf("socket_fd is %d\n", (int)socket_fd);
-  printf("readable is %d\n", (int)readable);
-  printf("writable is %d\n\n\n", (int)writable);
-}
-
+#include <milou/io.h>
+#include <milou/metrics.h>
 
 namespace milou {
   namespace dns {
 
+    // Per-thread resolver metrics, see milou::metrics for dumping them.
+    // Latencies are recorded in ns and reported in us.
+    struct DNSMetrics : public milou::metrics::Set {
+      static const int STATUSES = 32;
+
+      DNSMetrics()
+        : Set("dns")
+      {
+        add("queries", queries);
+        add("timeouts", timeouts);
+        add("retried", retried);
+        add("sockets_opened", sockets_opened);
+        add("sockets_closed", sockets_closed);
+        for (int i = 0; i < STATUSES; ++i) {
+          if (status_name(i))
+            add(milou::string::String("status.") + status_name(i), status[i]);
+        }
+        add("in_flight", in_flight);
+        add("queued", queued);
+        add("latency_us", latency, 1000);
+      }
+
+      static DNSMetrics& local() { return milou::metrics::local<DNSMetrics>(); }
+
+      // Names for the c-ares statuses a lookup can end with, anything else
+      // is counted as "other".
+      static const char*
+      status_name(int status)
+      {
+        switch (status) {
+        case ARES_SUCCESS: return "success";
+        case ARES_ENODATA: return "nodata";
+        case ARES_EFORMERR: return "formerr";
+        case ARES_ESERVFAIL: return "servfail";
+        case ARES_ENOTFOUND: return "notfound";
+        case ARES_ENOTIMP: return "notimp";
+        case ARES_EREFUSED: return "refused";
+        case ARES_EBADNAME: return "badname";
+        case ARES_EBADRESP: return "badresp";
+        case ARES_ECONNREFUSED: return "connrefused";
+        case ARES_ETIMEOUT: return "timeout";
+        case ARES_ENOMEM: return "nomem";
+        case ARES_EDESTRUCTION: return "destruction";
+        case ARES_ECANCELLED: return "cancelled";
+        case STATUSES - 1: return "other";
+        default: return NULL;
+        }
+      }
+
+      void
+      done(int code, int ntimeouts, uint64_t ns)
+      {
+        ++status[(code >= 0 && code < STATUSES && status_name(code)) ? code : STATUSES - 1];
+        if (ntimeouts > 0) {
+          timeouts.add(ntimeouts);
+          ++retried;
+        }
+        latency.record(ns);
+      }
+
+      milou::metrics::Counter queries;
+      milou::metrics::Counter timeouts;
+      milou::metrics::Counter retried;
+      milou::metrics::Counter sockets_opened;
+      milou::metrics::Counter sockets_closed;
+      milou::metrics::Counter status[STATUSES];
+      milou::metrics::Gauge in_flight;
+      milou::metrics::Gauge queued;
+      milou::metrics::Histogram latency;
+    };
+
+    // Punycode (RFC 3492) encoding of one UTF-8 label, appended to out with
+    // the "xn--" prefix. Returns false on invalid UTF-8. Note that this does
+    // not do the Unicode case folding / normalization of full IDNA.
+    inline bool
+    punycode(milou::string::StringView label, milou::string::String& out)
+    {
+      const uint32_t base = 36, tmin = 1, tmax = 26, skew = 38, damp = 700;
+      std::vector<uint32_t> cps;
+      uint32_t n = 128, delta = 0, bias = 72, h, b = 0;
+
+      for (size_t i = 0; i < label.size(); ) {
+        unsigned char c = label[i];
+        uint32_t cp;
+        size_t len;
+
+        if (c < 0x80) { cp = c; len = 1; }
+        else if ((c & 0xe0) == 0xc0) { cp = c & 0x1f; len = 2; }
+        else if ((c & 0xf0) == 0xe0) { cp = c & 0x0f; len = 3; }
+        else if ((c & 0xf8) == 0xf0) { cp = c & 0x07; len = 4; }
+        else return false;
+
+        if (i + len > label.size())
+          return false;
+        for (size_t j = 1; j < len; ++j) {
+          if ((label[i + j] & 0xc0) != 0x80)
+            return false;
+          cp = (cp << 6) | (label[i + j] & 0x3f);
+        }
+        if (cp > 0x10ffff || (len > 1 && cp < 0x80))
+          return false;
+        cps.push_back(cp);
+        i += len;
+      }
+
+      out += "xn--";
+      for (auto cp : cps) {
+        if (cp < 0x80) {
+          out += static_cast<char>(cp);
+          ++b;
+        }
+      }
+      if (b > 0)
+        out += '-';
+
+      for (h = b; h < cps.size(); ++delta, ++n) {
+        uint32_t m = UINT32_MAX;
+
+        for (auto cp : cps)
+          if (cp >= n && cp < m)
+            m = cp;
+        delta += (m - n) * (h + 1);
+        n = m;
+
+        for (auto cp : cps) {
+          if (cp < n)
+            ++delta;
+          if (cp == n) {
+            uint32_t q = delta;
+
+            for (uint32_t k = base; ; k += base) {
+              uint32_t t = k <= bias ? tmin : (k >= bias + tmax ? tmax : k - bias);
+              uint32_t d;
+
+              if (q < t)
+                break;
+              d = t + (q - t) % (base - t);
+              out += static_cast<char>(d < 26 ? 'a' + d : '0' + d - 26);
+              q = (q - t) / (base - t);
+            }
+            out += static_cast<char>(q < 26 ? 'a' + q : '0' + q - 26);
+
+            // Adapt the bias
+            delta = (h == b) ? delta / damp : delta / 2;
+            delta += delta / (h + 1);
+            for (bias = 0; delta > ((base - tmin) * tmax) / 2; bias += base)
+              delta /= base - tmin;
+            bias += (base - tmin + 1) * delta / (delta + skew);
+
+            delta = 0;
+            ++h;
+          }
+        }
+      }
+
+      return true;
+    }
+
+    // Canonicalize a host name before we send it to the resolver: lower case
+    // it, strip the trailing dot, and enforce the LDH rules (plus '_') with
+    // the 63 / 253 byte label and name limits. Non-ASCII labels are rejected,
+    // unless idna is set, in which case they get punycoded. Returns false if
+    // the name is not a valid host name.
+    inline bool
+    canonicalize(milou::string::StringView name, milou::string::String& out, bool idna=false)
+    {
+      size_t bad;
+
+      if (!name.empty() && name.back() == '.')
+        name.remove_suffix(1);
+      if (name.empty() || name.size() > 253)
+        return false;
+
+      out.assign(name.data(), name.size());
+      bad = milou::string::find_first_not_in(out, "az09AZ-.__");
+
+      if (bad != milou::string::StringView::npos) {
+        milou::string::String encoded;
+        bool ok = true;
+
+        if (!idna || static_cast<unsigned char>(out[bad]) < 0x80)
+          return false;
+
+        // Slow path, punycode any label with non-ASCII in it.
+        milou::string::split_each(out, ".", [&](milou::string::StringView label) {
+            if (!encoded.empty())
+              encoded += '.';
+            for (auto c : label) {
+              if (static_cast<unsigned char>(c) >= 0x80) {
+                milou::string::String lc = milou::string::lc(label);
+
+                ok = ok && punycode(lc, encoded);
+                return;
+              }
+            }
+            encoded.append(label.data(), label.size());
+          });
+        if (!ok || encoded.size() > 253 || milou::string::find_first_not_in(encoded, "az09AZ-.__") != milou::string::StringView::npos)
+          return false;
+        out.swap(encoded);
+      }
+
+      milou::string::lower(out);
+
+      for (milou::string::StringView rest(out); ; ) {
+        const char *dot = milou::string::find_char(rest.data(), rest.size(), '.');
+        size_t len = dot ? dot - rest.data() : rest.size();
+
+        if (len == 0 || len > 63 || rest[0] == '-' || rest[len - 1] == '-')
+          return false;
+        if (!dot)
+          break;
+        rest.remove_prefix(len + 1);
+      }
+
+      return true;
+    }
+
     // Class holding one response object (tightly integrated with the Request)
     class DNSResponse {
     public:
@@ -53,24 +266,32 @@ namespace milou {
         : mDomain(s), mHostent(h)
       { }
 
-      // Return a given IP in the response (first by default)
-      milou::string::String
-      ip(int ix = 0) const
+      // Return a given address in the response (first by default), for
+      // formatting with a milou::io::Writer. The addr is NULL if there is none.
+      milou::io::Address
+      address(int ix = 0) const
       {
+        milou::io::Address ip = { AF_INET, NULL };
+
         if (mHostent && mHostent->h_addr_list) {
           char **list = mHostent->h_addr_list;
-          char ip[INET6_ADDRSTRLEN];
 
           while (*list && ix-- > 0)
             ++list;
-
-          if (*list) {
-            inet_ntop(mHostent->h_addrtype, *list, ip, sizeof(ip));
-            return ip;
-          }
+          ip.family = mHostent->h_addrtype;
+          ip.addr = *list;
         }
 
-        return milou::string::NULL_STRING;
+        return ip;
+      }
+
+      // Return a given IP in the response (first by default)
+      milou::string::String
+      ip(int ix = 0) const
+      {
+        char ip[milou::io::MAX_IP_LEN];
+
+        return milou::string::String(ip, milou::io::format_ip(address(ix), ip));
       }
 
       // Return a vector of all IPs, as strings.
@@ -78,16 +299,14 @@ namespace milou {
       ips() const
       {
         milou::array::Strings str;
+        char ip[milou::io::MAX_IP_LEN];
 
-        if (mHostent && mHostent->h_addr_list) {
-          char **list = mHostent->h_addr_list;
-          char ip[INET6_ADDRSTRLEN];
+        for (int ix = 0; ; ++ix) {
+          milou::io::Address addr = address(ix);
 
-          while (*list) {
-            inet_ntop(mHostent->h_addrtype, *list, ip, sizeof(ip));
-            ++list;
-          }
-          str.push_back(ip);
+          if (!addr.addr)
+            break;
+          str.push_back(milou::string::String(ip, milou::io::format_ip(addr, ip)));
         }
 
         return str;
@@ -116,20 +335,13 @@ namespace milou {
 #else
       DNSResolver(int p=10, DNSCallback func=NULL)
 #endif
-        : _parallel(p), _callback(func), _reqs(0)
+        : _parallel(p), _callback(func), _reqs(0), _idna(false)
 
       {
-        // ToDo: We should have an option class awrapper too
-        struct ares_options options;
-
 #if CARES_HAVE_ARES_LIBRARY_INIT
         ares_library_init(ARES_LIB_INIT_ALL);
 #endif
-        options.sock_state_cb = sock_callback;
-        options.sock_state_cb_data = NULL;
-        options.lookups = const_cast<char*>("b");
-
-        ares_init_options(&_channel, &options, ARES_OPT_LOOKUPS|ARES_OPT_SOCK_STATE_CB);
+        _init(&_channel, 0, 0);
       }
 
       // DTOR
@@ -149,34 +361,84 @@ namespace milou {
 
       milou::array::Strings& domains() { return _domains; }
 
+      // Names queued or in flight.
+      size_t pending() const { return _domains.size() + _reqs; }
+
+      bool idna() const { return _idna; }
+      bool idna(bool i) { return (_idna = i); }
+
+      // Use these name servers instead of the ones in resolv.conf, as a
+      // comma separated list of host[:port].
+      bool servers(const char *csv) { return ares_set_servers_ports_csv(_channel, csv) == ARES_SUCCESS; }
+
+      // Timeout of the first try of a lookup (later tries back off), and the
+      // number of tries, instead of c-ares' 5s and 4. This sets up a new
+      // channel (keeping the servers), so call it before queuing anything.
       bool
-      queue(milou::string::String& s)
+      timeout(int ms, int tries = 4)
       {
-        if (s.size() > 0) {
-          _domains.push_back(s);
+        struct ares_addr_port_node *servers = NULL;
+        ares_channel channel;
+
+        if (!_init(&channel, ms, tries))
+          return false;
+        if (ares_get_servers_ports(_channel, &servers) == ARES_SUCCESS && servers) {
+          ares_set_servers_ports(channel, servers);
+          ares_free_data(servers);
+        }
+        ares_destroy(_channel);
+        _channel = channel;
+        return true;
+      }
+
+      // Queue a host name for resolution, this is canonicalized first, and
+      // false is returned (and nothing queued) if it is not a valid name.
+      bool
+      queue(milou::string::StringView s)
+      {
+        milou::string::String name;
+
+        if (canonicalize(s, name, _idna)) {
+          _domains.push_back(std::move(name));
           return true;
         }
         return false;
       }
 
+      // Queue a name that is canonical already, e.g. from
+      // milou::flow::read_names(), without doing it all over again.
       void
-      cancel(milou::string::String& s)
+      queue_canonical(milou::string::String name)
       {
-        auto it = find(_domains.begin(), _domains.end(), s);
+        _domains.push_back(std::move(name));
+      }
+
+      void
+      cancel(milou::string::StringView s)
+      {
+        milou::string::String name;
+
+        if (!canonicalize(s, name, _idna))
+          return;
+
+        auto it = find(_domains.begin(), _domains.end(), name);
 
         if (it != _domains.end())
           _domains.erase(it);
       }
       
-      void sort() { milou::array::sort(_domains); }
-      void unique() { milou::array::unique(_domains); }
+      void sort() { milou::array::parallel_radix_sort(_domains); }
+      void unique() { milou::array::parallel_unique(_domains); }
 
       bool process()
       {
         int nfds;
         fd_set readers, writers;
         struct timeval tv, *tvp;
+        milou::events::LoopMetrics& loop = milou::events::LoopMetrics::local();
+        milou::metrics::Timer timer(loop.iteration);
 
+        ++loop.iterations;
         while (_domains.size() > 0 && _reqs < _parallel) {
           DNSRequest *req = _allocator.construct(this, _callback);
 
@@ -191,14 +453,18 @@ namespace milou {
         FD_ZERO(&readers);
         FD_ZERO(&writers);
         nfds = ares_fds(_channel, &readers, &writers);
-        if (nfds == 0)
-          return false;
+        if (nfds > 0) {
+          tvp = ares_timeout(_channel, NULL, &tv);
+          select(nfds, &readers, &writers, NULL, tvp);
+          ares_process(_channel, &readers, &writers);
+        }
 
-        tvp = ares_timeout(_channel, NULL, &tv);
-        select(nfds, &readers, &writers, NULL, tvp);
-        ares_process(_channel, &readers, &writers);
+        DNSMetrics& m = DNSMetrics::local();
 
-        return true;
+        m.in_flight.set(_reqs);
+        m.queued.set(_domains.size());
+
+        return nfds > 0;
       }
 
       // Process all requests... This is a "main" event loop.
@@ -214,11 +480,55 @@ namespace milou {
 
 
     private:
+      // ToDo: We should have an option class awrapper too
+      bool
+      _init(ares_channel *channel, int timeout, int tries)
+      {
+        struct ares_options options;
+        int mask = ARES_OPT_LOOKUPS|ARES_OPT_SOCK_STATE_CB;
+
+        options.sock_state_cb = _sock_callback;
+        options.sock_state_cb_data = this;
+        options.lookups = const_cast<char*>("b");
+        // All the replies come in on one socket, and with many lookups in
+        // flight a burst of them overflows the default buffer, and those
+        // lookups time out. This is only a limit (clamped by the kernel to
+        // net.core.rmem_max), the memory is not used up front.
+        options.socket_receive_buffer_size = 4 * 1024 * 1024;
+        mask |= ARES_OPT_SOCK_RCVBUF;
+        if (timeout > 0) {
+          options.timeout = timeout;
+          mask |= ARES_OPT_TIMEOUTMS;
+        }
+        if (tries > 0) {
+          options.tries = tries;
+          mask |= ARES_OPT_TRIES;
+        }
+
+        return ares_init_options(channel, &options, mask) == ARES_SUCCESS;
+      }
+
+      // This is called whenever c-ares changes what it waits for on a socket,
+      // so only the first and last calls for each socket are counted.
+      static void
+      _sock_callback(void *data, ares_socket_t fd, int readable, int writable)
+      {
+        DNSResolver *res = static_cast<DNSResolver*>(data);
+        DNSMetrics& m = DNSMetrics::local();
+
+        if (readable || writable) {
+          if (res->_sockets.insert(fd).second)
+            ++m.sockets_opened;
+        } else if (res->_sockets.erase(fd)) {
+          ++m.sockets_closed;
+        }
+      }
+
       class DNSRequest {
       public:
 
         DNSRequest(DNSResolver *resolver, DNSCallback func)
-          : _domain(""), _resolver(resolver), _function(func)
+          : _domain(""), _start(0), _resolver(resolver), _function(func)
         { }
 
         ~DNSRequest() { --_resolver->_reqs; }
@@ -229,6 +539,8 @@ namespace milou {
           if (_resolver->_domains.size() > 0) {
             _domain = _resolver->_domains.back();
             _resolver->_domains.pop_back();
+            _start = milou::metrics::now();
+            ++DNSMetrics::local().queries;
             ares_gethostbyname(_resolver->channel(), _domain.c_str(), AF_INET, (ares_host_callback)&_callback, this);
             return true;
           }
@@ -246,14 +558,20 @@ namespace milou {
           DNSRequest *req = static_cast<DNSRequest*>(arg);
           DNSResponse resp(req->_domain, hostent);
 
-          req->_function(resp);
+          DNSMetrics::local().done(status, timeouts, milou::metrics::now() - req->_start);
+          if (req->_function) {
+            milou::metrics::Timer timer(milou::events::LoopMetrics::local().callback);
+
+            req->_function(resp);
+          }
 
-          // Kick off more requests, if possible.
-          if (!req->lookupNext())
+          // Kick off more requests, if possible, unless the channel is going away.
+          if (status == ARES_EDESTRUCTION || !req->lookupNext())
             req->_resolver->_allocator.destroy(req);
         }
 
         milou::string::String _domain;
+        uint64_t _start;
         DNSResolver *_resolver;
         DNSCallback _function;
       };
@@ -263,6 +581,8 @@ namespace milou {
       DNSCallback _callback;
       ev_io _fds[1024];
       int _reqs;
+      bool _idna;
+      std::unordered_set<ares_socket_t> _sockets; // Open, for the metrics
       milou::array::Strings _domains;
       boost::object_pool<DNSRequest> _allocator;
     };
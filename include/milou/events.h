@@ -26,9 +26,29 @@
 #include <libev/ev.h>
 #include <vector>
 
+#include <milou/metrics.h>
+
 namespace milou {
   namespace events {
 
+    // Per-thread event loop timings, times are recorded in ns and reported
+    // in us. An iteration includes the time spent waiting for events.
+    struct LoopMetrics : public milou::metrics::Set {
+      LoopMetrics()
+        : Set("loop")
+      {
+        add("iterations", iterations);
+        add("iteration_us", iteration, 1000);
+        add("callback_us", callback, 1000);
+      }
+
+      static LoopMetrics& local() { return milou::metrics::local<LoopMetrics>(); }
+
+      milou::metrics::Counter iterations;
+      milou::metrics::Histogram iteration;
+      milou::metrics::Histogram callback;
+    };
+
     // Base class for all event handling classes.
     class EventLoop;
     class EventHandler {
@@ -0,0 +1,541 @@
+/** @file
+
+    Threaded pipelines, where each stage runs on its own thread(s), and the
+    stages are connected with bounded, lock-free queues.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one or more
+    contributor license agreements.  See the NOTICE file distributed with
+    this work for additional information regarding copyright ownership.  The
+    ASF licenses this file to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance with the
+    License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <milou/string.h>
+#include <milou/io.h>
+#include <milou/dns.h>
+
+namespace milou {
+  namespace flow {
+
+    // Waiting on a full or empty queue: spin a little, then yield, then sleep.
+    class Backoff {
+    public:
+      Backoff() : _n(0) { }
+
+      void
+      wait()
+      {
+        if (_n < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+          __builtin_ia32_pause();
+#endif
+        } else if (_n < 128) {
+          std::this_thread::yield();
+        } else {
+          std::this_thread::sleep_for(std::chrono::microseconds(_n < 256 ? 50 : 500));
+        }
+        ++_n;
+      }
+
+      void reset() { _n = 0; }
+
+    private:
+      unsigned _n;
+    };
+
+    // Bounded MPMC queue (Vyukov's), any number of threads can push and pop.
+    // Each slot has a sequence number, which tells a producer or consumer if
+    // the slot is ready for it; the only contention is on the head / tail.
+    template <typename T>
+    class Queue {
+    public:
+      // The capacity is rounded up to a power of 2.
+      explicit Queue(size_t capacity = 64)
+        : _head(0), _tail(0)
+      {
+        for (_size = 2; _size < capacity; _size <<= 1)
+          ;
+        _mask = _size - 1;
+        _slots.reset(new Slot[_size]);
+        for (size_t i = 0; i < _size; ++i)
+          _slots[i].seq.store(i, std::memory_order_relaxed);
+      }
+
+      Queue(const Queue&) = delete;
+      Queue& operator=(const Queue&) = delete;
+
+      size_t capacity() const { return _size; }
+
+      // Returns false (and leaves v alone) if the queue is full.
+      bool
+      try_push(T& v)
+      {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        Slot *s;
+
+        while (1) {
+          s = &_slots[pos & _mask];
+          size_t seq = s->seq.load(std::memory_order_acquire);
+          ptrdiff_t diff = static_cast<ptrdiff_t>(seq - pos);
+
+          if (diff == 0) {
+            if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              break;
+          } else if (diff < 0) {
+            return false;
+          } else {
+            pos = _tail.load(std::memory_order_relaxed);
+          }
+        }
+
+        s->value = std::move(v);
+        s->seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Returns false if the queue is empty.
+      bool
+      try_pop(T& v)
+      {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        Slot *s;
+
+        while (1) {
+          s = &_slots[pos & _mask];
+          size_t seq = s->seq.load(std::memory_order_acquire);
+          ptrdiff_t diff = static_cast<ptrdiff_t>(seq - (pos + 1));
+
+          if (diff == 0) {
+            if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              break;
+          } else if (diff < 0) {
+            return false;
+          } else {
+            pos = _head.load(std::memory_order_relaxed);
+          }
+        }
+
+        v = std::move(s->value);
+        s->seq.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+      }
+
+    private:
+      struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+      };
+
+      // Keep the producers and consumers off each other's cache lines. This
+      // pads rather than uses alignas(), which C++11 new does not honor.
+      char _pad0[64];
+      std::atomic<size_t> _head;
+      char _pad1[64 - sizeof(std::atomic<size_t>)];
+      std::atomic<size_t> _tail;
+      char _pad2[64 - sizeof(std::atomic<size_t>)];
+      size_t _size;
+      size_t _mask;
+      std::unique_ptr<Slot[]> _slots;
+    };
+
+    // A Channel connects two stages. Items go through the Queue in batches, so
+    // the queue operations are paid once per batch, not once per item. Pushing
+    // to a full channel blocks the producer (backpressure), and once all the
+    // producers are done, pop() drains what is left and then returns false.
+    template <typename T>
+    class Channel {
+    public:
+      typedef std::vector<T> Batch;
+
+      static const size_t BATCH_SIZE = 256;
+
+      explicit Channel(size_t capacity = 64, size_t batch = BATCH_SIZE)
+        : _queue(capacity), _batch(batch ? batch : 1), _producers(0)
+      { }
+
+      Channel(const Channel&) = delete;
+      Channel& operator=(const Channel&) = delete;
+
+      size_t batch_size() const { return _batch; }
+
+      // Producers must be added before any consumer starts to pop.
+      void add_producers(int n) { _producers += n; }
+      void producer_done() { _producers.fetch_sub(1, std::memory_order_release); }
+
+      void
+      push(Batch& b)
+      {
+        Backoff backoff;
+
+        while (!_queue.try_push(b))
+          backoff.wait();
+      }
+
+      bool try_pop(Batch& b) { return _queue.try_pop(b); }
+
+      // Blocks until there is a batch, or the end of the stream.
+      bool
+      pop(Batch& b)
+      {
+        Backoff backoff;
+
+        while (1) {
+          if (_queue.try_pop(b))
+            return true;
+          if (_producers.load(std::memory_order_acquire) == 0)
+            return _queue.try_pop(b); // Anything pushed just before the last one finished
+          backoff.wait();
+        }
+      }
+
+    private:
+      Queue<Batch> _queue;
+      size_t _batch;
+      std::atomic<int> _producers;
+    };
+
+    // Each producing thread gets its own Emitter, which fills up a batch and
+    // hands it to the channel when full. The last, partial, batch goes out
+    // when the Emitter is destroyed, which is also the end of this producer.
+    template <typename T>
+    class Emitter {
+    public:
+      explicit Emitter(Channel<T>& out)
+        : _out(out)
+      {
+        _batch.reserve(_out.batch_size());
+      }
+
+      Emitter(const Emitter&) = delete;
+      Emitter& operator=(const Emitter&) = delete;
+
+      ~Emitter()
+      {
+        flush();
+        _out.producer_done();
+      }
+
+      void
+      emit(T&& v)
+      {
+        _batch.push_back(std::move(v));
+        if (_batch.size() >= _out.batch_size())
+          flush();
+      }
+
+      void emit(const T& v) { emit(T(v)); }
+
+      void
+      flush()
+      {
+        if (!_batch.empty()) {
+          _out.push(_batch);
+          _batch.clear();
+          _batch.reserve(_out.batch_size());
+        }
+      }
+
+    private:
+      Channel<T>& _out;
+      typename Channel<T>::Batch _batch;
+    };
+
+    // Builds the stages, and runs them all at once. All the stages and the
+    // channels are set up first, then run() starts every thread and waits for
+    // the end of the stream to make it through to the last stage. E.g.
+    //
+    //    Flow flow;
+    //    auto& names = flow.channel<String>();
+    //    auto& ips = flow.channel<Resolved>();
+    //
+    //    flow.source(names, read_names(in));
+    //    flow.worker(names, ips, 4, resolve_names(100));
+    //    flow.sink(ips, 1, [&out](Resolved& r) { ... });
+    //    flow.run();
+    class Flow {
+    public:
+      Flow() { }
+
+      Flow(const Flow&) = delete;
+      Flow& operator=(const Flow&) = delete;
+
+      // Channels are owned by the Flow. The capacity is in batches.
+      template <typename T>
+      Channel<T>&
+      channel(size_t capacity = 64, size_t batch = Channel<T>::BATCH_SIZE)
+      {
+        Channel<T> *c = new Channel<T>(capacity, batch);
+
+        _channels.push_back(std::shared_ptr<void>(c, [](void *p) { delete static_cast<Channel<T>*>(p); }));
+        return *c;
+      }
+
+      // One thread producing items: f(Emitter<Out>&).
+      template <typename Out, typename F>
+      void
+      source(Channel<Out>& out, F f)
+      {
+        out.add_producers(1);
+        _stages.push_back([&out, f]() {
+            Emitter<Out> emit(out);
+
+            f(emit);
+          });
+      }
+
+      // A stage that runs its own loop on each thread: f(Channel<In>&, Emitter<Out>&).
+      // This is for stages that need to see more than one item at a time.
+      template <typename In, typename Out, typename F>
+      void
+      worker(Channel<In>& in, Channel<Out>& out, unsigned threads, F f)
+      {
+        threads = std::max(1u, threads);
+        out.add_producers(threads);
+        for (unsigned i = 0; i < threads; ++i) {
+          _stages.push_back([&in, &out, f]() {
+              Emitter<Out> emit(out);
+
+              f(in, emit);
+            });
+        }
+      }
+
+      // A stage that maps each item to any number of outputs: f(In&, Emitter<Out>&).
+      template <typename In, typename Out, typename F>
+      void
+      stage(Channel<In>& in, Channel<Out>& out, unsigned threads, F f)
+      {
+        worker(in, out, threads, [f](Channel<In>& c, Emitter<Out>& emit) {
+            typename Channel<In>::Batch batch;
+
+            while (c.pop(batch)) {
+              for (auto& v : batch)
+                f(v, emit);
+            }
+          });
+      }
+
+      // The end of the line: f(In&).
+      template <typename In, typename F>
+      void
+      sink(Channel<In>& in, unsigned threads, F f)
+      {
+        threads = std::max(1u, threads);
+        for (unsigned i = 0; i < threads; ++i) {
+          _stages.push_back([&in, f]() {
+              typename Channel<In>::Batch batch;
+
+              while (in.pop(batch)) {
+                for (auto& v : batch)
+                  f(v);
+              }
+            });
+        }
+      }
+
+      // Start all the stages, and wait for all of them to finish. A Flow runs once.
+      void
+      run()
+      {
+        std::vector<std::thread> threads;
+
+        threads.reserve(_stages.size());
+        for (auto& s : _stages)
+          threads.emplace_back(std::move(s));
+        _stages.clear();
+        for (auto& t : threads)
+          t.join();
+      }
+
+    private:
+      std::vector<std::function<void ()>> _stages;
+      std::vector<std::shared_ptr<void>> _channels;
+    };
+
+    // Built in stages, for the read -> dedupe -> resolve -> write scripts.
+
+    // Source: lines from a LineReader, trimmed, with empty lines dropped.
+    inline std::function<void (Emitter<milou::string::String>&)>
+    read_lines(milou::string::LineReader& in)
+    {
+      return [&in](Emitter<milou::string::String>& out) {
+        milou::string::StringView line;
+
+        while (milou::string::getline(in, line)) {
+          milou::string::trim(line);
+          if (!line.empty())
+            out.emit(milou::string::String(line.data(), line.size()));
+        }
+      };
+    }
+
+    // Source: host names from a LineReader, one per line, canonicalized (see
+    // milou::dns::canonicalize()) so that dedupe() sees "Example.COM" and
+    // "example.com." as the same name. Invalid names are dropped here.
+    inline std::function<void (Emitter<milou::string::String>&)>
+    read_names(milou::string::LineReader& in, bool idna = false)
+    {
+      return [&in, idna](Emitter<milou::string::String>& out) {
+        milou::string::StringView line;
+        milou::string::String name;
+
+        while (milou::string::getline(in, line)) {
+          milou::string::trim(line);
+          if (milou::dns::canonicalize(line, name, idna))
+            out.emit(std::move(name));
+        }
+      };
+    }
+
+    // Stage: drop items already seen. This keeps state, so run it on one thread.
+    template <typename T>
+    std::function<void (T&, Emitter<T>&)>
+    dedupe()
+    {
+      std::shared_ptr<std::unordered_set<T>> seen(new std::unordered_set<T>());
+
+      return [seen](T& v, Emitter<T>& out) {
+        if (seen->insert(v).second)
+          out.emit(std::move(v));
+      };
+    }
+
+    // The result of a lookup. The name is moved out of the resolver's request
+    // (which is done with it), and the first address is copied out of the
+    // hostent, which is freed after the callback. There is no IP string, a
+    // Writer formats address() straight into its buffer.
+    struct Resolved {
+      milou::string::String name;
+      int family;               // 0 if the name did not resolve
+      char addr[16];
+
+      milou::io::Address
+      address() const
+      {
+        milou::io::Address ip = { family, family ? addr : NULL };
+
+        return ip;
+      }
+    };
+
+    inline std::function<void (Channel<milou::string::String>&, Emitter<Resolved>&)>
+    _resolve(int parallel, bool idna, bool canonical, std::function<void (milou::dns::DNSResolver&)> setup)
+    {
+      return [parallel, idna, canonical, setup](Channel<milou::string::String>& in, Emitter<Resolved>& out) {
+        static std::mutex init; // c-ares library init / cleanup is not thread safe
+        std::unique_ptr<milou::dns::DNSResolver> res;
+        Channel<milou::string::String>::Batch batch;
+        bool eos = false;
+
+        {
+          std::lock_guard<std::mutex> l(init);
+
+          res.reset(new milou::dns::DNSResolver(parallel, [&out](const milou::dns::DNSResponse& r) {
+                milou::io::Address ip = r.address();
+                Resolved done = { std::move(r.mDomain), 0, { 0 } };
+
+                if (ip.addr) {
+                  done.family = ip.family;
+                  memcpy(done.addr, ip.addr, ip.family == AF_INET6 ? 16 : 4);
+                }
+                out.emit(std::move(done));
+              }));
+          res->idna(idna);
+          if (setup)
+            setup(*res);
+        }
+
+        while (!eos || res->pending() > 0) {
+          if (!eos && res->domains().size() < static_cast<size_t>(parallel)) {
+            bool got;
+
+            if (res->pending() > 0) {
+              got = in.try_pop(batch);
+            } else {
+              out.flush(); // Idle, don't sit on a partial batch while we wait
+              got = in.pop(batch);
+              eos = !got;
+            }
+            for (size_t i = 0; got && i < batch.size(); ++i) {
+              if (canonical)
+                res->queue_canonical(std::move(batch[i]));
+              else
+                res->queue(batch[i]);
+            }
+          }
+          res->process();
+        }
+
+        std::lock_guard<std::mutex> l(init);
+
+        res.reset();
+      };
+    }
+
+    // Worker: resolve names, with one DNSResolver per thread, each doing up
+    // to parallel lookups at a time. New names are only taken from the input
+    // when the resolver runs low, so a slow DNS server backs up the readers.
+    // Each resolver is passed to setup(), if any, e.g. to set its servers().
+    inline std::function<void (Channel<milou::string::String>&, Emitter<Resolved>&)>
+    resolve(int parallel = 10, bool idna = false, std::function<void (milou::dns::DNSResolver&)> setup = NULL)
+    {
+      return _resolve(parallel, idna, false, setup);
+    }
+
+    // Worker: the same, for names from read_names(), which are canonical
+    // already and are queued as they are.
+    inline std::function<void (Channel<milou::string::String>&, Emitter<Resolved>&)>
+    resolve_names(int parallel = 10, std::function<void (milou::dns::DNSResolver&)> setup = NULL)
+    {
+      return _resolve(parallel, false, true, setup);
+    }
+
+    // Sink: write each item with format(Writer&, T&). The Writer is not
+    // thread safe, so this must run on one thread.
+    template <typename T, typename F>
+    std::function<void (T&)>
+    write_to(milou::io::Writer& w, F format)
+    {
+      return [&w, format](T& v) { format(w, v); };
+    }
+
+  } // namespace flow
+} // namespace milou
+
+
+/*
+  local variables:
+  mode: C++
+  indent-tabs-mode: nil
+  c-basic-offset: 2
+  c-comment-only-line-offset: 0
+  c-file-offsets: ((statement-block-intro . +)
+  (label . 0)
+  (statement-cont . +)
+  (innamespace . 0))
+  end:
+*/
@@ -0,0 +1,319 @@
+/** @file
+
+    Buffered output, and formatters that write straight into the buffer.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one or more
+    contributor license agreements.  See the NOTICE file distributed with
+    this work for additional information regarding copyright ownership.  The
+    ASF licenses this file to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance with the
+    License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include <milou/string.h>
+
+namespace milou {
+  namespace io {
+
+    // Formatters, these write into out (which must have room) and return the
+    // number of bytes written. Nothing is NUL terminated.
+    const size_t MAX_INT_LEN = 20;
+    const size_t MAX_IP_LEN = INET6_ADDRSTRLEN;
+    const size_t MIN_BUFFER_SIZE = 256;
+
+    inline size_t
+    format_uint(uint64_t u, char *out)
+    {
+      static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+      char tmp[MAX_INT_LEN];
+      char *p = tmp + sizeof(tmp);
+
+      // Two digits at a time
+      while (u >= 100) {
+        const char *d = digits + (u % 100) * 2;
+
+        u /= 100;
+        *--p = d[1];
+        *--p = d[0];
+      }
+      if (u >= 10) {
+        *--p = digits[u * 2 + 1];
+        *--p = digits[u * 2];
+      } else {
+        *--p = '0' + u;
+      }
+
+      memcpy(out, p, tmp + sizeof(tmp) - p);
+      return tmp + sizeof(tmp) - p;
+    }
+
+    inline size_t
+    format_int(int64_t i, char *out)
+    {
+      if (i < 0) {
+        *out = '-';
+        return 1 + format_uint(0 - static_cast<uint64_t>(i), out + 1);
+      }
+      return format_uint(i, out);
+    }
+
+    inline size_t
+    format_ipv4(const void *addr, char *out)
+    {
+      const unsigned char *a = static_cast<const unsigned char*>(addr);
+      char *p = out;
+
+      for (int i = 0; i < 4; ++i) {
+        unsigned b = a[i];
+
+        // At most 3 digits, skip the leading zeros without branching on each
+        *p = '0' + b / 100;
+        p += (b >= 100);
+        *p = '0' + (b / 10) % 10;
+        p += (b >= 10);
+        *p++ = '0' + b % 10;
+        *p++ = '.';
+      }
+
+      return p - out - 1;
+    }
+
+    // Same output as inet_ntop(): the longest run of two or more zero words
+    // becomes "::", and IPv4 mapped / compatible addresses end in a.b.c.d.
+    inline size_t
+    format_ipv6(const void *addr, char *out)
+    {
+      static const char hex[] = "0123456789abcdef";
+      const unsigned char *a = static_cast<const unsigned char*>(addr);
+      unsigned words[8];
+      int best = -1, best_len = 0, cur = -1, cur_len = 0;
+      char *p = out;
+
+      for (int i = 0; i < 8; ++i) {
+        words[i] = (a[2 * i] << 8) | a[2 * i + 1];
+        if (words[i] == 0) {
+          if (cur < 0) {
+            cur = i;
+            cur_len = 0;
+          }
+          if (++cur_len > best_len) {
+            best = cur;
+            best_len = cur_len;
+          }
+        } else {
+          cur = -1;
+        }
+      }
+      if (best_len < 2)
+        best = -1;
+
+      for (int i = 0; i < 8; ++i) {
+        if (i == best) {
+          *p++ = ':';
+          if (i == 0)
+            *p++ = ':';
+          i += best_len - 1;
+          continue;
+        }
+        if (i == 6 && best == 0 && (best_len == 6 || (best_len == 5 && words[5] == 0xffff)))
+          return p - out + format_ipv4(a + 12, p);
+
+        unsigned w = words[i];
+        int shift = w >= 0x1000 ? 12 : w >= 0x100 ? 8 : w >= 0x10 ? 4 : 0;
+
+        for (; shift >= 0; shift -= 4)
+          *p++ = hex[(w >> shift) & 0xf];
+        if (i < 7)
+          *p++ = ':';
+      }
+
+      return p - out;
+    }
+
+    // An IPv4 or IPv6 address, in network order (e.g. from a hostent).
+    struct Address {
+      int family;
+      const void *addr;
+    };
+
+    inline size_t
+    format_ip(const Address& ip, char *out)
+    {
+      if (!ip.addr)
+        return 0;
+      return ip.family == AF_INET6 ? format_ipv6(ip.addr, out) : format_ipv4(ip.addr, out);
+    }
+
+    // A large, reusable output buffer. Writes bigger than half the buffer go
+    // out together with what is buffered, in one writev(), without a copy.
+    // The buffer is flushed when the Writer is destroyed.
+    class Writer {
+    public:
+      static const size_t BUFFER_SIZE = 1024 * 1024;
+
+      explicit Writer(int fd = STDOUT_FILENO, size_t size = BUFFER_SIZE)
+        : _fd(fd), _own(false), _error(false), _buf(std::max(size, MIN_BUFFER_SIZE)), _len(0)
+      { }
+
+      // A path of "-" writes to STDOUT.
+      explicit Writer(const char *path, size_t size = BUFFER_SIZE)
+        : _fd(STDOUT_FILENO), _own(false), _error(false), _buf(std::max(size, MIN_BUFFER_SIZE)), _len(0)
+      {
+        if (strcmp(path, "-") != 0) {
+          _fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          _own = true;
+          _error = (_fd < 0);
+        }
+      }
+
+      Writer(const Writer&) = delete;
+      Writer& operator=(const Writer&) = delete;
+
+      ~Writer()
+      {
+        flush();
+        if (_own && _fd >= 0)
+          ::close(_fd);
+      }
+
+      bool good() const { return !_error; }
+
+      // Room for at least n bytes, for formatting in place. Follow up with
+      // commit() of the bytes actually used. n must fit in the buffer.
+      char*
+      reserve(size_t n)
+      {
+        if (_buf.size() - _len < n)
+          flush();
+        return &_buf[_len];
+      }
+
+      void commit(size_t n) { _len += n; }
+
+      Writer&
+      write(const char *data, size_t n)
+      {
+        if (n > _buf.size() / 2) {
+          struct iovec iov[2] = { { &_buf[0], _len }, { const_cast<char*>(data), n } };
+
+          _writev(iov, 2);
+          _len = 0;
+        } else {
+          memcpy(reserve(n), data, n);
+          _len += n;
+        }
+        return *this;
+      }
+
+      bool
+      flush()
+      {
+        if (_len > 0) {
+          struct iovec iov = { &_buf[0], _len };
+
+          _writev(&iov, 1);
+          _len = 0;
+        }
+        return !_error;
+      }
+
+      Writer& operator<<(milou::string::StringView s) { return write(s.data(), s.size()); }
+      Writer& operator<<(const milou::string::String& s) { return write(s.data(), s.size()); }
+      Writer& operator<<(const char *s) { return write(s, strlen(s)); }
+
+      Writer&
+      operator<<(char c)
+      {
+        *reserve(1) = c;
+        ++_len;
+        return *this;
+      }
+
+      template <typename T>
+      typename std::enable_if<std::is_integral<T>::value, Writer&>::type
+      operator<<(T i)
+      {
+        char *p = reserve(MAX_INT_LEN + 1);
+
+        _len += std::is_signed<T>::value ? format_int(i, p) : format_uint(i, p);
+        return *this;
+      }
+
+      Writer&
+      operator<<(const Address& ip)
+      {
+        _len += format_ip(ip, reserve(MAX_IP_LEN));
+        return *this;
+      }
+
+    private:
+      void
+      _writev(struct iovec *iov, int cnt)
+      {
+        while (cnt > 0 && !_error) {
+          ssize_t n = ::writev(_fd, iov, cnt);
+
+          if (n < 0) {
+            _error = (errno != EINTR);
+            continue;
+          }
+          // Partial write, skip what went out
+          for (; cnt > 0 && static_cast<size_t>(n) >= iov->iov_len; ++iov, --cnt)
+            n -= iov->iov_len;
+          if (cnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+          }
+        }
+      }
+
+      int _fd;
+      bool _own;
+      bool _error;
+      std::vector<char> _buf;
+      size_t _len;
+    };
+
+  } // namespace io
+} // namespace milou
+
+
+/*
+  local variables:
+  mode: C++
+  indent-tabs-mode: nil
+  c-basic-offset: 2
+  c-comment-only-line-offset: 0
+  c-file-offsets: ((statement-block-intro . +)
+  (label . 0)
+  (statement-cont . +)
+  (innamespace . 0))
+  end:
+*/
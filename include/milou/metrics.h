@@ -0,0 +1,429 @@
+/** @file
+
+    Low overhead, per-thread metrics: counters, gauges and latency histograms,
+    with text or JSON dumps, on demand or periodically.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one or more
+    contributor license agreements.  See the NOTICE file distributed with
+    this work for additional information regarding copyright ownership.  The
+    ASF licenses this file to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance with the
+    License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <milou/string.h>
+#include <milou/io.h>
+
+namespace milou {
+  namespace metrics {
+
+    // Monotonic nanoseconds.
+    inline uint64_t
+    now()
+    {
+      struct timespec ts;
+
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // Every metric is only ever updated by the thread that owns it, so an
+    // update is a plain load and store. They are atomics only so that a dump
+    // from another thread is safe.
+    class Counter {
+    public:
+      Counter() : _v(0) { }
+
+      void add(uint64_t n = 1) { _v.store(_v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+      Counter& operator++() { add(); return *this; }
+
+      uint64_t value() const { return _v.load(std::memory_order_relaxed); }
+
+    private:
+      std::atomic<uint64_t> _v;
+    };
+
+    class Gauge {
+    public:
+      Gauge() : _v(0) { }
+
+      void set(int64_t v) { _v.store(v, std::memory_order_relaxed); }
+      void add(int64_t n) { _v.store(_v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+      int64_t value() const { return _v.load(std::memory_order_relaxed); }
+
+    private:
+      std::atomic<int64_t> _v;
+    };
+
+    // HDR style histogram: values up to 2 * SUB are exact, and every power of 2
+    // above that is split into SUB linear buckets, so any value is off by at
+    // most 1 / SUB (about 3%). Covers the whole uint64_t range.
+    class Histogram {
+    public:
+      static const int SUB_BITS = 5;
+      static const uint64_t SUB = 1 << SUB_BITS;
+      static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+      static size_t
+      bucket(uint64_t v)
+      {
+        if (v < 2 * SUB)
+          return v;
+
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+
+        return shift * SUB + (v >> shift);
+      }
+
+      // The smallest value, and the width, of a bucket.
+      static uint64_t lowest(size_t b) { return b < 2 * SUB ? b : (b % SUB + SUB) << (b / SUB - 1); }
+      static uint64_t width(size_t b) { return b < 2 * SUB ? 1 : uint64_t(1) << (b / SUB - 1); }
+
+      // A plain copy of one or more histograms, for reporting.
+      struct Snapshot {
+        Snapshot() : buckets(BUCKETS), count(0), sum(0), min(UINT64_MAX), max(0) { }
+
+        // The p'th percentile (0 - 100), as the middle of its bucket.
+        uint64_t
+        percentile(double p) const
+        {
+          uint64_t want = static_cast<uint64_t>(p / 100 * count + 0.5), seen = 0;
+
+          if (count == 0)
+            return 0;
+          want = std::max<uint64_t>(1, std::min(want, count));
+          for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen >= want)
+              return std::max(min, std::min(max, lowest(b) + (width(b) - 1) / 2));
+          }
+          return max;
+        }
+
+        double mean() const { return count ? static_cast<double>(sum) / count : 0; }
+
+        std::vector<uint64_t> buckets;
+        uint64_t count, sum, min, max;
+      };
+
+      Histogram()
+        : _buckets(new std::atomic<uint64_t>[BUCKETS]), _count(0), _sum(0), _min(UINT64_MAX), _max(0)
+      {
+        for (size_t b = 0; b < BUCKETS; ++b)
+          _buckets[b].store(0, std::memory_order_relaxed);
+      }
+
+      void
+      record(uint64_t v)
+      {
+        std::atomic<uint64_t>& b = _buckets[bucket(v)];
+
+        b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _sum.store(_sum.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        if (v < _min.load(std::memory_order_relaxed))
+          _min.store(v, std::memory_order_relaxed);
+        if (v > _max.load(std::memory_order_relaxed))
+          _max.store(v, std::memory_order_relaxed);
+      }
+
+      uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+      // Add this histogram to a snapshot. Taken while the owner is recording,
+      // the count and the buckets can be off by the records in progress.
+      void
+      merge_into(Snapshot& s) const
+      {
+        for (size_t b = 0; b < BUCKETS; ++b)
+          s.buckets[b] += _buckets[b].load(std::memory_order_relaxed);
+        s.count += _count.load(std::memory_order_relaxed);
+        s.sum += _sum.load(std::memory_order_relaxed);
+        s.min = std::min(s.min, _min.load(std::memory_order_relaxed));
+        s.max = std::max(s.max, _max.load(std::memory_order_relaxed));
+      }
+
+    private:
+      std::unique_ptr<std::atomic<uint64_t>[]> _buckets;
+      std::atomic<uint64_t> _count, _sum, _min, _max;
+    };
+
+    // Records the time from construction to destruction, in nanoseconds.
+    class Timer {
+    public:
+      explicit Timer(Histogram& h) : _h(h), _start(now()) { }
+      ~Timer() { _h.record(now() - _start); }
+
+    private:
+      Histogram& _h;
+      uint64_t _start;
+    };
+
+    // All metrics, summed over all threads. Histograms are reported divided by
+    // their scale (e.g. 1000, to record nanoseconds but report microseconds).
+    struct Report {
+      struct Distribution {
+        Distribution() : scale(1) { }
+
+        Histogram::Snapshot data;
+        uint64_t scale;
+      };
+
+      time_t time;
+      std::map<milou::string::String, uint64_t> counters;
+      std::map<milou::string::String, int64_t> gauges;
+      std::map<milou::string::String, Distribution> histograms;
+    };
+
+    // A named group of metrics (e.g. "dns"), each thread gets its own copy
+    // from local<T>(). Subclasses add() their members in the constructor.
+    class Set {
+    public:
+      explicit Set(const char *name) : _name(name) { }
+      virtual ~Set() { }
+
+      Set(const Set&) = delete;
+      Set& operator=(const Set&) = delete;
+
+      const char* name() const { return _name; }
+
+      void
+      merge_into(Report& r) const
+      {
+        milou::string::String prefix = milou::string::String(_name) + '.';
+
+        for (auto& c : _counters)
+          r.counters[prefix + c.first] += c.second->value();
+        for (auto& g : _gauges)
+          r.gauges[prefix + g.first] += g.second->value();
+        for (auto& h : _histograms) {
+          Report::Distribution& d = r.histograms[prefix + h.first];
+
+          h.second.first->merge_into(d.data);
+          d.scale = h.second.second;
+        }
+      }
+
+    protected:
+      void add(const milou::string::String& name, Counter& c) { _counters.emplace_back(name, &c); }
+      void add(const milou::string::String& name, Gauge& g) { _gauges.emplace_back(name, &g); }
+      void add(const milou::string::String& name, Histogram& h, uint64_t scale = 1) { _histograms.emplace_back(name, std::make_pair(&h, scale)); }
+
+    private:
+      const char *_name;
+      std::vector<std::pair<milou::string::String, Counter*>> _counters;
+      std::vector<std::pair<milou::string::String, Gauge*>> _gauges;
+      std::vector<std::pair<milou::string::String, std::pair<Histogram*, uint64_t>>> _histograms;
+    };
+
+    // Owns every thread's metric sets. These outlive their threads, so that
+    // what a finished thread did still shows up in the totals.
+    class Registry {
+    public:
+      static Registry&
+      instance()
+      {
+        static Registry *reg = new Registry(); // Never destroyed, threads may outlive main()
+        return *reg;
+      }
+
+      void
+      add(Set *s)
+      {
+        std::lock_guard<std::mutex> l(_lock);
+        _sets.emplace_back(s);
+      }
+
+      Report
+      report()
+      {
+        Report r;
+        std::lock_guard<std::mutex> l(_lock);
+
+        r.time = ::time(NULL);
+        for (auto& s : _sets)
+          s->merge_into(r);
+        return r;
+      }
+
+    private:
+      std::mutex _lock;
+      std::vector<std::unique_ptr<Set>> _sets;
+    };
+
+    // This thread's instance of a metric set.
+    template <typename T>
+    T&
+    local()
+    {
+      static thread_local T *set = NULL;
+
+      if (!set) {
+        set = new T();
+        Registry::instance().add(set);
+      }
+      return *set;
+    }
+
+    // One "name value" line per counter and gauge, and one line per histogram.
+    inline void
+    write_text(milou::io::Writer& w, const Report& r)
+    {
+      char buf[64];
+
+      w << "# milou metrics " << static_cast<int64_t>(r.time) << '\n';
+      for (auto& c : r.counters)
+        w << c.first << ' ' << c.second << '\n';
+      for (auto& g : r.gauges)
+        w << g.first << ' ' << g.second << '\n';
+      for (auto& h : r.histograms) {
+        const Histogram::Snapshot& s = h.second.data;
+        double scale = h.second.scale;
+
+        w << h.first << " count=" << s.count;
+        if (s.count > 0) {
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), " min=%.1f mean=%.1f", s.min / scale, s.mean() / scale));
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), " p50=%.1f p90=%.1f", s.percentile(50) / scale, s.percentile(90) / scale));
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), " p99=%.1f p99.9=%.1f", s.percentile(99) / scale, s.percentile(99.9) / scale));
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), " max=%.1f", s.max / scale));
+        }
+        w << '\n';
+      }
+    }
+
+    // One JSON object per report, on one line. Metric names are used as is,
+    // they are expected to be plain identifiers.
+    inline void
+    write_json(milou::io::Writer& w, const Report& r)
+    {
+      char buf[64];
+
+      w << "{\"time\":" << static_cast<int64_t>(r.time);
+      for (auto& c : r.counters)
+        w << ",\"" << c.first << "\":" << c.second;
+      for (auto& g : r.gauges)
+        w << ",\"" << g.first << "\":" << g.second;
+      for (auto& h : r.histograms) {
+        const Histogram::Snapshot& s = h.second.data;
+        double scale = h.second.scale;
+
+        w << ",\"" << h.first << "\":{\"count\":" << s.count;
+        if (s.count > 0) {
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), ",\"min\":%.1f,\"mean\":%.1f", s.min / scale, s.mean() / scale));
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), ",\"p50\":%.1f,\"p90\":%.1f", s.percentile(50) / scale, s.percentile(90) / scale));
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), ",\"p99\":%.1f,\"p99.9\":%.1f", s.percentile(99) / scale, s.percentile(99.9) / scale));
+          w.commit(snprintf(w.reserve(sizeof(buf)), sizeof(buf), ",\"max\":%.1f", s.max / scale));
+        }
+        w << '}';
+      }
+      w << "}\n";
+    }
+
+    // Dumps all metrics every interval seconds, from its own thread, to a file
+    // or (with a NULL path) to STDERR. There is a final dump when destroyed.
+    class Reporter {
+    public:
+      enum Format { TEXT, JSON };
+
+      explicit Reporter(double interval, Format format = TEXT, const char *path = NULL)
+        : _format(format), _out(path ? new milou::io::Writer(path, 64 * 1024) : new milou::io::Writer(STDERR_FILENO, 64 * 1024)),
+          _stop(false)
+      {
+        std::chrono::milliseconds every(std::max<int64_t>(1, static_cast<int64_t>(interval * 1000)));
+
+        _thread = std::thread([this, every]() {
+            std::unique_lock<std::mutex> l(_lock);
+
+            while (!_cv.wait_for(l, every, [this]() { return _stop; }))
+              _dump();
+          });
+      }
+
+      Reporter(const Reporter&) = delete;
+      Reporter& operator=(const Reporter&) = delete;
+
+      ~Reporter()
+      {
+        {
+          std::lock_guard<std::mutex> l(_lock);
+          _stop = true;
+        }
+        _cv.notify_one();
+        _thread.join();
+        _dump();
+      }
+
+      bool good() const { return _out->good(); }
+
+      // Dump right now, as well.
+      void
+      dump()
+      {
+        std::lock_guard<std::mutex> l(_lock);
+
+        _dump();
+      }
+
+    private:
+      void
+      _dump()
+      {
+        Report r = Registry::instance().report();
+
+        if (_format == JSON)
+          write_json(*_out, r);
+        else
+          write_text(*_out, r);
+        _out->flush();
+      }
+
+      Format _format;
+      std::unique_ptr<milou::io::Writer> _out;
+      std::mutex _lock;
+      std::condition_variable _cv;
+      bool _stop;
+      std::thread _thread;
+    };
+
+  } // namespace metrics
+} // namespace milou
+
+
+/*
+  local variables:
+  mode: C++
+  indent-tabs-mode: nil
+  c-basic-offset: 2
+  c-comment-only-line-offset: 0
+  c-file-offsets: ((statement-block-intro . +)
+  (label . 0)
+  (statement-cont . +)
+  (innamespace . 0))
+  end:
+*/
@@ -35,8 +35,12 @@
 #include <milou/string.h>
 #include <milou/array.h>
 #include <milou/hash.h>
+#include <milou/io.h>
+#include <milou/metrics.h>
 #include <milou/perl.h>
+#include <milou/regex.h>
 #include <milou/dns.h>
+#include <milou/flow.h>
 
 // Also make sure to drag in the kitchen sink into the name space.
 using namespace std;
@@ -45,9 +49,12 @@ using namespace boost::algorithm;
 using namespace milou::string;
 using namespace milou::array;
 using namespace milou::hash;
+using namespace milou::io;
+using namespace milou::metrics;
 using namespace milou::events;
 using namespace milou::perl;
 using namespace milou::dns;
+using namespace milou::flow;
 
 
 /*
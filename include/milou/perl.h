@@ -26,14 +26,394 @@
 
 #pragma once
 
-#include <boost/any.hpp>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ostream>
+#include <type_traits>
+#include <utility>
+
+#include <milou/string.h>
+#include <milou/io.h>
 
 namespace milou {
   namespace perl {
 
-    typedef boost::any my;
+    // Visitors get this for an undefined Scalar.
+    struct Undef { };
+
+    // A Perl'ish scalar. Integers, doubles, strings up to 24 bytes and
+    // StringView's are all stored inline, only longer strings go on the heap.
+    // Like Perl's IOK / NOK / POK flags, a conversion (e.g. the string value
+    // of a number) is cached, so it's only done once. Note that a Scalar made
+    // from a StringView does not copy it, the viewed string must outlive it.
+    class Scalar {
+    public:
+      enum Type { UNDEF, INT, DOUBLE, STRING };
+
+      Scalar()
+        : _type(UNDEF), _flags(0)
+      { }
+
+      template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+      Scalar(T i)
+        : _type(INT), _flags(IOK), _iv(i)
+      { }
+
+      Scalar(double d)
+        : _type(DOUBLE), _flags(NOK), _nv(d)
+      { }
+
+      Scalar(const char *s)
+        : _type(STRING), _flags(0)
+      {
+        _set_str(s, strlen(s));
+      }
+
+      Scalar(const milou::string::String& s)
+        : _type(STRING), _flags(0)
+      {
+        _set_str(s.data(), s.size());
+      }
+
+      Scalar(milou::string::StringView s)
+        : _type(STRING), _flags(POK | VIEW), _sp(s.data()), _sn(s.size())
+      { }
+
+      Scalar(const Scalar& other)
+        : _type(UNDEF), _flags(0)
+      {
+        _copy(other);
+      }
+
+      Scalar(Scalar&& other)
+        : _type(UNDEF), _flags(0)
+      {
+        _move(other);
+      }
+
+      ~Scalar() { _clear(); }
+
+      Scalar&
+      operator=(const Scalar& other)
+      {
+        if (this != &other) {
+          _clear();
+          _copy(other);
+        }
+        return *this;
+      }
+
+      Scalar&
+      operator=(Scalar&& other)
+      {
+        if (this != &other) {
+          _clear();
+          _move(other);
+        }
+        return *this;
+      }
+
+      Type type() const { return _type; }
+      bool defined() const { return _type != UNDEF; }
+
+      // Perl's numeric value, "42abc" is 42 and "abc" is 0. As in Perl, a
+      // number out of range is clamped to INT64_MIN / INT64_MAX, and NaN is 0.
+      int64_t
+      iv() const
+      {
+        if (!(_flags & IOK)) {
+          if (_flags & NOK)
+            _iv = _clamp(_nv);
+          else if (_flags & POK)
+            _iv = _parse_iv();
+          else
+            _iv = 0;
+          _flags |= IOK;
+        }
+        return _iv;
+      }
+
+      double
+      nv() const
+      {
+        if (!(_flags & NOK)) {
+          if (_type == INT)
+            _nv = static_cast<double>(_iv);
+          else if (_flags & POK)
+            _nv = _parse_nv();
+          else
+            _nv = 0.0;
+          _flags |= NOK;
+        }
+        return _nv;
+      }
+
+      // Perl's string value, undef is "" and doubles are formatted with %.15g.
+      milou::string::StringView
+      str() const
+      {
+        if (!(_flags & POK)) {
+          if (_type == INT)
+            _sn = milou::io::format_int(_iv, _buf);
+          else if (_type == DOUBLE)
+            _sn = snprintf(_buf, sizeof(_buf), "%.15g", _nv);
+          else
+            _sn = 0;
+          _sp = _buf;
+          _flags |= POK;
+        }
+        return milou::string::StringView(_sp, _sn);
+      }
+
+      // Perl truth: undef, 0, "" and "0" are all false.
+      explicit operator bool() const
+      {
+        switch (_type) {
+        case UNDEF:
+          return false;
+        case INT:
+          return _iv != 0;
+        case DOUBLE:
+          return _nv != 0.0;
+        default:
+          return _sn > 1 || (_sn == 1 && _sp[0] != '0');
+        }
+      }
+
+      // Call f() with the value in its original type: Undef, int64_t, double
+      // or StringView. No RTTI involved, unlike boost::any_cast.
+      template <typename F>
+      auto
+      visit(F f) const -> decltype(f(Undef()))
+      {
+        switch (_type) {
+        case INT:
+          return f(_iv);
+        case DOUBLE:
+          return f(_nv);
+        case STRING:
+          return f(milou::string::StringView(_sp, _sn));
+        default:
+          return f(Undef());
+        }
+      }
+
+      // Perl's arithmetic: integer if both sides are integers and the result
+      // fits, otherwise double. Division is always done in double, as in
+      // Perl. These, and the numeric comparisons (Perl's == and <), are
+      // hidden friends, so they only apply when one side already is a
+      // Scalar, and never to e.g. a String and a StringView.
+      friend Scalar
+      operator+(const Scalar& a, const Scalar& b)
+      {
+        int64_t r;
+
+        if (_both_int(a, b) && !__builtin_add_overflow(a.iv(), b.iv(), &r))
+          return Scalar(r);
+        return Scalar(a.nv() + b.nv());
+      }
+
+      friend Scalar
+      operator-(const Scalar& a, const Scalar& b)
+      {
+        int64_t r;
+
+        if (_both_int(a, b) && !__builtin_sub_overflow(a.iv(), b.iv(), &r))
+          return Scalar(r);
+        return Scalar(a.nv() - b.nv());
+      }
+
+      friend Scalar
+      operator*(const Scalar& a, const Scalar& b)
+      {
+        int64_t r;
+
+        if (_both_int(a, b) && !__builtin_mul_overflow(a.iv(), b.iv(), &r))
+          return Scalar(r);
+        return Scalar(a.nv() * b.nv());
+      }
+
+      friend Scalar
+      operator/(const Scalar& a, const Scalar& b)
+      {
+        return Scalar(a.nv() / b.nv());
+      }
+
+      friend bool operator==(const Scalar& a, const Scalar& b) { return a.nv() == b.nv(); }
+      friend bool operator!=(const Scalar& a, const Scalar& b) { return a.nv() != b.nv(); }
+      friend bool operator<(const Scalar& a, const Scalar& b) { return a.nv() < b.nv(); }
+      friend bool operator>(const Scalar& a, const Scalar& b) { return a.nv() > b.nv(); }
+
+      friend std::ostream&
+      operator<<(std::ostream& os, const Scalar& s)
+      {
+        milou::string::StringView v = s.str();
+
+        return os.write(v.data(), v.size());
+      }
+
+    private:
+      static bool
+      _both_int(const Scalar& a, const Scalar& b)
+      {
+        return (a.type() == INT || (a.type() == STRING && a.nv() == a.iv())) &&
+          (b.type() == INT || (b.type() == STRING && b.nv() == b.iv()));
+      }
+
+      enum Flags { IOK = 1, NOK = 2, POK = 4, VIEW = 8, HEAP = 16 };
+      static const size_t SMALL = 24;
+
+      // A double to int64_t cast is undefined out of range, so clamp first.
+      static int64_t
+      _clamp(double d)
+      {
+        if (d != d)
+          return 0; // NaN
+        if (d >= 9223372036854775808.0)
+          return INT64_MAX;
+        if (d <= -9223372036854775808.0)
+          return INT64_MIN;
+        return static_cast<int64_t>(d);
+      }
+
+      int64_t
+      _parse_iv() const
+      {
+        const char *p = _sp, *end = _sp + _sn;
+        uint64_t u = 0;
+        bool neg = false;
+
+        while (p < end && memchr(milou::string::WHITESPACE, *p, 6))
+          ++p;
+        if (p < end && (*p == '-' || *p == '+'))
+          neg = (*p++ == '-');
+        for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+          if (u > (static_cast<uint64_t>(INT64_MAX) - 9) / 10)
+            return _clamp(_parse_nv()); // Too big for the accumulator
+          u = u * 10 + (*p - '0');
+        }
+
+        // Things like "1e3" or "2.5" need the full double parse.
+        if (p < end && (*p == '.' || *p == 'e' || *p == 'E'))
+          return _clamp(_parse_nv());
+        return neg ? -static_cast<int64_t>(u) : static_cast<int64_t>(u);
+      }
+
+      double
+      _parse_nv() const
+      {
+        char tmp[64];
+        size_t n = std::min(_sn, sizeof(tmp) - 1);
+
+        memcpy(tmp, _sp, n);
+        tmp[n] = '\0';
+        return strtod(tmp, NULL);
+      }
+
+      void
+      _set_str(const char *s, size_t n)
+      {
+        if (n <= SMALL) {
+          memcpy(_buf, s, n);
+          _sp = _buf;
+        } else {
+          _heap = new milou::string::String(s, n);
+          _sp = _heap->data();
+          _flags |= HEAP;
+        }
+        _sn = n;
+        _flags |= POK;
+      }
+
+      void
+      _copy(const Scalar& other)
+      {
+        _type = other._type;
+        _flags = other._flags & ~HEAP;
+        _iv = other._iv;
+        _nv = other._nv;
+        if ((other._flags & POK) && !(other._flags & VIEW)) {
+          _flags &= ~POK;
+          _set_str(other._sp, other._sn);
+        } else {
+          _sp = other._sp;
+          _sn = other._sn;
+        }
+      }
+
+      void
+      _move(Scalar& other)
+      {
+        if (other._flags & HEAP) {
+          _type = other._type;
+          _flags = other._flags;
+          _iv = other._iv;
+          _nv = other._nv;
+          _heap = other._heap;
+          _sp = other._sp;
+          _sn = other._sn;
+          other._flags = 0;
+          other._type = UNDEF;
+        } else {
+          _copy(other);
+        }
+      }
+
+      void
+      _clear()
+      {
+        if (_flags & HEAP)
+          delete _heap;
+        _flags = 0;
+      }
+
+      Type _type;
+      mutable uint8_t _flags;
+      mutable int64_t _iv = 0;
+      mutable double _nv = 0.0;
+      mutable const char *_sp = NULL;
+      mutable size_t _sn = 0;
+      union {
+        mutable char _buf[SMALL];
+        milou::string::String *_heap;
+      };
+    };
+
+    // Perl's string comparisons (eq, ne and cmp).
+    inline bool eq(const Scalar& a, const Scalar& b) { return a.str() == b.str(); }
+    inline bool ne(const Scalar& a, const Scalar& b) { return a.str() != b.str(); }
+    inline int cmp(const Scalar& a, const Scalar& b) { return a.str().compare(b.str()); }
+
+    typedef Scalar my;
+
+    // For scripts written against the old boost::any based my, these are
+    // coercions now, rather than type checked casts. There are no reference
+    // casts, any_cast<const String&>(my) does not compile.
+    template <typename T>
+    inline typename std::enable_if<std::is_integral<T>::value, T>::type
+    any_cast(const Scalar& s)
+    {
+      return static_cast<T>(s.iv());
+    }
+
+    template <typename T>
+    inline typename std::enable_if<std::is_floating_point<T>::value, T>::type
+    any_cast(const Scalar& s)
+    {
+      return static_cast<T>(s.nv());
+    }
+
+    template <typename T>
+    inline typename std::enable_if<std::is_same<T, milou::string::String>::value, T>::type
+    any_cast(const Scalar& s)
+    {
+      milou::string::StringView v = s.str();
 
-    using boost::any_cast;
+      return T(v.data(), v.size());
+    }
 
   } // namespace perl
 } // namespace milou
@@ -0,0 +1,1123 @@
+/** @file
+
+    Perl'ish regular expressions, for =~ style matching and s/// style
+    substitutions, with captures as StringView's.
+
+    A Regex is compiled once, when constructed. Plain literal patterns
+    (optionally anchored) are matched with the string kernels directly.
+    Anything else is compiled to a program which is turned into a DFA up
+    front, for fast match / no match answers, while captures are found with
+    a memoizing backtracker (short strings) or a Pike VM. All of these are
+    linear in the input. Supported is the common subset of Perl syntax: . [] [^]
+    ^ $ | () (?:) * + ? {n,m} (and the lazy versions), \d \w \s \D \W \S
+    and the usual escapes. There are no back references, look-arounds or \b.
+    As in Perl (without /m), $ matches at the end, or before a final newline.
+    Patterns that compile to huge programs (e.g. deeply nested {n,m}) are
+    rejected, and good() is false.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one or more
+    contributor license agreements.  See the NOTICE file distributed with
+    this work for additional information regarding copyright ownership.  The
+    ASF licenses this file to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance with the
+    License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#pragma once
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <vector>
+
+#include <milou/string.h>
+
+namespace milou {
+  namespace perl {
+
+    // The captures of a match, as views into the matched string. Group 0 is
+    // the entire match, unmatched groups are empty (and have a NULL data()).
+    class Match {
+    public:
+      milou::string::StringView
+      operator[](size_t i) const
+      {
+        return i < _groups.size() ? _groups[i] : milou::string::StringView();
+      }
+
+      size_t size() const { return _groups.size(); }
+
+    private:
+      friend class Regex;
+
+      std::vector<milou::string::StringView> _groups;
+    };
+
+    class Regex {
+    public:
+      // Flags are Perl's modifiers, only "i" (case insensitive) for now.
+      explicit Regex(milou::string::StringView pattern, milou::string::StringView flags = "")
+        : _good(true), _icase(flags.find('i') != milou::string::StringView::npos),
+          _groups(0), _literal(false), _bol(false), _eol(false), _pos(0), _pattern(pattern)
+      {
+        int root = _parse_alt();
+
+        if (_pos != _pattern.size())
+          _good = false;
+        _pattern = milou::string::StringView(); // No need to keep this around
+
+        if (_good) {
+          _analyze(root);
+          _emit(SAVE, 0);
+          _compile(root);
+          _emit(SAVE, 1);
+          _emit(MATCH);
+          if (_prog.size() > MAX_PROG || _prog.size() * 2 * (_groups + 1) > MAX_CAPS)
+            _good = false;
+        }
+        if (_good)
+          _build_dfa();
+        else
+          _prog.clear();
+        _nodes.clear();
+      }
+
+      // False if the pattern did not parse, and then nothing matches.
+      bool good() const { return _good; }
+
+      // The number of capture groups, not counting group 0.
+      size_t groups() const { return _groups; }
+
+      bool
+      match(milou::string::StringView s) const
+      {
+        if (!_good)
+          return false;
+        if (_literal)
+          return _match_literal(s, NULL);
+        if (!_dfa.empty())
+          return _match_dfa(s, 0);
+
+        std::vector<const char*> caps;
+        return _pike(s, 0, caps);
+      }
+
+      bool
+      match(milou::string::StringView s, Match& m) const
+      {
+        return search(s, 0, m);
+      }
+
+      // Find the leftmost match starting at or after offset from. ^ still
+      // only matches at the start of s.
+      bool
+      search(milou::string::StringView s, size_t from, Match& m) const
+      {
+        std::vector<const char*> caps;
+
+        m._groups.clear();
+        if (!_good || from > s.size())
+          return false;
+
+        if (_literal) {
+          caps.resize(2);
+          if (!_match_literal(s.substr(from), &caps[0]) || (_bol && from > 0))
+            return false;
+        } else {
+          if (!_dfa.empty() && !_match_dfa(s, from))
+            return false;
+          if (_prog.size() * (s.size() - from + 1) <= MAX_BACKTRACK) {
+            if (!_backtrack(s, from, caps))
+              return false;
+          } else if (!_pike(s, from, caps)) {
+            return false;
+          }
+        }
+
+        m._groups.resize(caps.size() / 2);
+        for (size_t i = 0; i < m._groups.size(); ++i)
+          if (caps[2 * i])
+            m._groups[i] = milou::string::StringView(caps[2 * i], caps[2 * i + 1] - caps[2 * i]);
+        return true;
+      }
+
+    private:
+      enum Op { CHAR, CLASS, SPLIT, JMP, SAVE, BOL, EOL, MATCH };
+      enum Kind { LIT, SET, CAT, ALT, REPEAT, GROUP, ABOL, AEOL, EMPTY };
+      typedef std::bitset<256> CharSet;
+
+      // Parse tree, only used while compiling.
+      struct Node {
+        Kind kind;
+        int arg;                // Literal byte, class index, or group number
+        int min, max;           // Repeats, max < 0 is unbounded
+        bool greedy;
+        std::vector<int> kids;
+      };
+
+      struct Inst {
+        Op op;
+        int x, y;
+      };
+
+      static const int MAX_REPEAT = 1000;
+      static const size_t MAX_DFA_STATES = 4096;
+      static const size_t MAX_BACKTRACK = 256 * 1024; // Visited bits
+      static const size_t MAX_PROG = 16384;             // Instructions
+      static const size_t MAX_CAPS = 1024 * 1024;       // Pike VM capture slots
+
+      // Parser, recursive descent. Errors just clear _good.
+      int
+      _node(Kind kind, int arg = 0)
+      {
+        Node n = { kind, arg, 0, 0, true, std::vector<int>() };
+
+        _nodes.push_back(n);
+        return _nodes.size() - 1;
+      }
+
+      bool _more() const { return _pos < _pattern.size(); }
+      char _peek() const { return _pattern[_pos]; }
+
+      int
+      _parse_alt()
+      {
+        int first = _parse_cat();
+
+        if (!_more() || _peek() != '|')
+          return first;
+
+        int alt = _node(ALT);
+
+        _nodes[alt].kids.push_back(first);
+        while (_more() && _peek() == '|') {
+          ++_pos;
+          int kid = _parse_cat();
+          _nodes[alt].kids.push_back(kid);
+        }
+        return alt;
+      }
+
+      int
+      _parse_cat()
+      {
+        int cat = _node(CAT);
+
+        while (_good && _more() && _peek() != '|' && _peek() != ')') {
+          int atom = _parse_atom();
+
+          while (_good && _more() && _parse_repeat(atom))
+            ;
+          _nodes[cat].kids.push_back(atom);
+        }
+        return cat;
+      }
+
+      // Wraps atom in a REPEAT if there is a quantifier next.
+      bool
+      _parse_repeat(int& atom)
+      {
+        int min, max;
+        size_t start = _pos;
+
+        switch (_peek()) {
+        case '*': min = 0; max = -1; ++_pos; break;
+        case '+': min = 1; max = -1; ++_pos; break;
+        case '?': min = 0; max = 1; ++_pos; break;
+        case '{':
+          ++_pos;
+          if (!_parse_int(min)) {
+            _pos = start;
+            return false;
+          }
+          max = min;
+          if (_more() && _peek() == ',') {
+            ++_pos;
+            if (!_parse_int(max))
+              max = -1;
+          }
+          if (!_more() || _peek() != '}') {
+            _pos = start; // Perl treats it as a literal {
+            return false;
+          }
+          ++_pos;
+          if (min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min))
+            _good = false;
+          break;
+        default:
+          return false;
+        }
+
+        int rep = _node(REPEAT);
+
+        _nodes[rep].min = min;
+        _nodes[rep].max = max;
+        _nodes[rep].kids.push_back(atom);
+        if (_more() && _peek() == '?') {
+          _nodes[rep].greedy = false;
+          ++_pos;
+        }
+        atom = rep;
+        return true;
+      }
+
+      bool
+      _parse_int(int& val)
+      {
+        size_t start = _pos;
+
+        for (val = 0; _more() && _peek() >= '0' && _peek() <= '9' && val <= MAX_REPEAT; ++_pos)
+          val = val * 10 + (_peek() - '0');
+        return _pos > start;
+      }
+
+      int
+      _set(const CharSet& cs)
+      {
+        _classes.push_back(cs);
+        return _node(SET, _classes.size() - 1);
+      }
+
+      // The \d, \w and \s style classes, returns false for anything else.
+      static bool
+      _escape_class(char c, CharSet& cs)
+      {
+        CharSet tmp;
+
+        switch (c | 0x20) {
+        case 'd':
+          for (int i = '0'; i <= '9'; ++i)
+            tmp.set(i);
+          break;
+        case 'w':
+          for (int i = 0; i < 256; ++i)
+            if ((i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') || (i >= '0' && i <= '9') || i == '_')
+              tmp.set(i);
+          break;
+        case 's':
+          for (const char *p = milou::string::WHITESPACE; *p; ++p)
+            tmp.set(static_cast<unsigned char>(*p));
+          break;
+        default:
+          return false;
+        }
+
+        cs |= (c >= 'a') ? tmp : ~tmp;
+        return true;
+      }
+
+      // A literal escape, e.g. \n or \. (or \x41).
+      int
+      _escape_char(char c)
+      {
+        switch (c) {
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case 'e': return 27;
+        case '0': return 0;
+        case 'x':
+          if (_pos + 2 <= _pattern.size()) {
+            char *end;
+            char hex[3] = { _pattern[_pos], _pattern[_pos + 1], 0 };
+            long v = strtol(hex, &end, 16);
+
+            if (end == hex + 2) {
+              _pos += 2;
+              return v;
+            }
+          }
+          _good = false;
+          return 0;
+        default:
+          // Letters (e.g. \b or \A) are assertions we do not support.
+          if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '1' && c <= '9'))
+            _good = false;
+          return static_cast<unsigned char>(c);
+        }
+      }
+
+      int
+      _parse_atom()
+      {
+        char c = _pattern[_pos++];
+        CharSet cs;
+
+        switch (c) {
+        case '(':
+          {
+            int group = _node(GROUP, -1);
+
+            if (_pos + 1 < _pattern.size() && _peek() == '?' && _pattern[_pos + 1] == ':')
+              _pos += 2;
+            else
+              _nodes[group].arg = ++_groups;
+
+            int inner = _parse_alt();
+
+            _nodes[group].kids.push_back(inner);
+            if (!_more() || _peek() != ')')
+              _good = false;
+            ++_pos;
+            return group;
+          }
+        case '[':
+          return _parse_class();
+        case '.':
+          cs.set();
+          cs.reset('\n');
+          return _set(cs);
+        case '^':
+          return _node(ABOL);
+        case '$':
+          return _node(AEOL);
+        case '*':
+        case '+':
+        case '?':
+          _good = false; // Quantifier follows nothing
+          return _node(EMPTY);
+        case '\\':
+          if (!_more()) {
+            _good = false;
+            return _node(EMPTY);
+          }
+          c = _pattern[_pos++];
+          if (_escape_class(c, cs))
+            return _set(cs);
+          return _literal_node(_escape_char(c));
+        default:
+          return _literal_node(static_cast<unsigned char>(c));
+        }
+      }
+
+      int
+      _literal_node(int c)
+      {
+        if (_icase && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+          CharSet cs;
+
+          cs.set(c | 0x20);
+          cs.set(c & ~0x20);
+          return _set(cs);
+        }
+        return _node(LIT, c);
+      }
+
+      int
+      _parse_class()
+      {
+        CharSet cs;
+        bool negate = false, first = true;
+
+        if (_more() && _peek() == '^') {
+          negate = true;
+          ++_pos;
+        }
+
+        while (_more() && (_peek() != ']' || first)) {
+          int lo = static_cast<unsigned char>(_pattern[_pos++]);
+
+          first = false;
+          if (lo == '\\' && _more()) {
+            char e = _pattern[_pos++];
+
+            if (_escape_class(e, cs))
+              continue;
+            lo = _escape_char(e);
+          }
+
+          int hi = lo;
+
+          if (_pos + 1 < _pattern.size() && _peek() == '-' && _pattern[_pos + 1] != ']') {
+            ++_pos;
+            hi = static_cast<unsigned char>(_pattern[_pos++]);
+            if (hi == '\\' && _more())
+              hi = _escape_char(_pattern[_pos++]);
+            if (hi < lo)
+              _good = false;
+          }
+          for (int i = lo; i <= hi; ++i)
+            cs.set(i);
+        }
+
+        if (!_more())
+          _good = false;
+        ++_pos;
+
+        if (_icase) {
+          for (int i = 'a'; i <= 'z'; ++i) {
+            if (cs[i] || cs[i & ~0x20]) {
+              cs.set(i);
+              cs.set(i & ~0x20);
+            }
+          }
+        }
+        if (negate)
+          cs.flip();
+        return _set(cs);
+      }
+
+      // Find the literal prefix, and whether the whole pattern is a literal.
+      void
+      _analyze(int root)
+      {
+        const Node *n = &_nodes[root];
+        size_t i = 0, end;
+
+        // A top level CAT, possibly wrapping a single ALT or GROUP etc.
+        if (n->kind != CAT)
+          return;
+        end = n->kids.size();
+        if (i < end && _nodes[n->kids[i]].kind == ABOL) {
+          _bol = true;
+          ++i;
+        }
+        if (end > i && _nodes[n->kids[end - 1]].kind == AEOL) {
+          _eol = true;
+          --end;
+        }
+        for (; i < end && _nodes[n->kids[i]].kind == LIT; ++i)
+          _prefix += static_cast<char>(_nodes[n->kids[i]].arg);
+        _literal = (i == end && _groups == 0);
+      }
+
+      void
+      _emit(Op op, int x = 0, int y = 0)
+      {
+        Inst inst = { op, x, y };
+
+        _prog.push_back(inst);
+      }
+
+      void
+      _compile(int ix)
+      {
+        if (_prog.size() > MAX_PROG)
+          return; // Too big, the constructor gives up on it
+
+        Node n = _nodes[ix]; // A copy, _compile() does not add nodes, but be safe
+
+        switch (n.kind) {
+        case LIT:
+          _emit(CHAR, n.arg);
+          break;
+        case SET:
+          _emit(CLASS, n.arg);
+          break;
+        case CAT:
+          for (auto kid : n.kids)
+            _compile(kid);
+          break;
+        case ALT:
+          {
+            std::vector<size_t> jumps;
+
+            for (size_t i = 0; i < n.kids.size(); ++i) {
+              if (i + 1 < n.kids.size()) {
+                size_t split = _prog.size();
+
+                _emit(SPLIT, split + 1, 0);
+                _compile(n.kids[i]);
+                jumps.push_back(_prog.size());
+                _emit(JMP);
+                _prog[split].y = _prog.size();
+              } else {
+                _compile(n.kids[i]);
+              }
+            }
+            for (auto j : jumps)
+              _prog[j].x = _prog.size();
+          }
+          break;
+        case REPEAT:
+          {
+            // x+ and x{n,} loop back over their last copy of x, rather than
+            // adding an x* after it, so nesting them does not double the program.
+            bool plus = (n.max < 0 && n.min > 0);
+
+            for (int i = 0; i < n.min - plus; ++i)
+              _compile(n.kids[0]);
+
+            if (plus) {
+              size_t body = _prog.size(), split;
+
+              _compile(n.kids[0]);
+              split = _prog.size();
+              _emit(SPLIT);
+              _branch(split, body, split + 1, n.greedy);
+            } else if (n.max < 0) {
+              size_t split = _prog.size();
+
+              _emit(SPLIT);
+              _compile(n.kids[0]);
+              _emit(JMP, split);
+              _branch(split, split + 1, _prog.size(), n.greedy);
+            } else {
+              std::vector<size_t> splits;
+
+              for (int i = n.min; i < n.max; ++i) {
+                splits.push_back(_prog.size());
+                _emit(SPLIT);
+                _compile(n.kids[0]);
+              }
+              for (auto s : splits)
+                _branch(s, s + 1, _prog.size(), n.greedy);
+            }
+          }
+          break;
+        case GROUP:
+          if (n.arg > 0)
+            _emit(SAVE, 2 * n.arg);
+          _compile(n.kids[0]);
+          if (n.arg > 0)
+            _emit(SAVE, 2 * n.arg + 1);
+          break;
+        case ABOL:
+          _emit(BOL);
+          break;
+        case AEOL:
+          _emit(EOL);
+          break;
+        case EMPTY:
+          break;
+        }
+      }
+
+      void
+      _branch(size_t split, int body, int out, bool greedy)
+      {
+        _prog[split].x = greedy ? body : out;
+        _prog[split].y = greedy ? out : body;
+      }
+
+      bool
+      _match_literal(milou::string::StringView s, const char **caps) const
+      {
+        size_t at;
+
+        milou::string::StringView chomped = s;
+
+        // $ also matches before a final newline, which is the leftmost match
+        if (_eol && !s.empty() && s.back() == '\n' && s.size() > _prefix.size() &&
+            s.substr(0, s.size() - 1).ends_with(_prefix))
+          chomped.remove_suffix(1);
+
+        if (_bol && _eol)
+          at = (chomped == milou::string::StringView(_prefix)) ? 0 : milou::string::StringView::npos;
+        else if (_bol)
+          at = s.starts_with(_prefix) ? 0 : milou::string::StringView::npos;
+        else if (_eol)
+          at = chomped.ends_with(_prefix) ? chomped.size() - _prefix.size() : milou::string::StringView::npos;
+        else
+          at = milou::string::find_substr(s, _prefix);
+
+        if (at == milou::string::StringView::npos)
+          return false;
+        if (caps) {
+          caps[0] = s.data() + at;
+          caps[1] = caps[0] + _prefix.size();
+        }
+        return true;
+      }
+
+      // The DFA states are sets of program counters, sitting on CHAR, CLASS,
+      // EOL or MATCH instructions.
+      void
+      _closure(int pc, bool at_begin, std::vector<bool>& seen, std::vector<int>& set) const
+      {
+        if (seen[pc])
+          return;
+        seen[pc] = true;
+
+        const Inst& inst = _prog[pc];
+
+        switch (inst.op) {
+        case JMP:
+          _closure(inst.x, at_begin, seen, set);
+          break;
+        case SPLIT:
+          _closure(inst.x, at_begin, seen, set);
+          _closure(inst.y, at_begin, seen, set);
+          break;
+        case SAVE:
+          _closure(pc + 1, at_begin, seen, set);
+          break;
+        case BOL:
+          if (at_begin)
+            _closure(pc + 1, at_begin, seen, set);
+          break;
+        default:
+          set.push_back(pc);
+          break;
+        }
+      }
+
+      int
+      _dfa_state(std::vector<int>& set, std::map<std::vector<int>, int>& ids, std::vector<std::vector<int> >& sets)
+      {
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+
+        auto it = ids.find(set);
+
+        if (it != ids.end())
+          return it->second;
+
+        int id = sets.size();
+        bool accept = false;
+
+        if (set.empty())
+          _dead = id;
+        for (auto pc : set)
+          accept = accept || _prog[pc].op == MATCH;
+        ids[set] = id;
+        sets.push_back(set);
+        _accept.push_back(accept);
+        _dfa.resize(_dfa.size() + _nsyms, -1);
+        return id;
+      }
+
+      // Build the whole DFA up front, so that matching never modifies the
+      // Regex and it can be shared between threads. Gives up (and leaves
+      // it all to the Pike VM) if the DFA gets too big.
+      void
+      _build_dfa()
+      {
+        std::map<std::vector<int>, int> ids;
+        std::vector<std::vector<int> > sets;
+        std::vector<int> restart, set;
+        std::vector<bool> seen(_prog.size());
+        std::vector<int> reps;
+
+        // Bytes that no instruction tells apart share a column in the DFA.
+        std::map<std::vector<bool>, int> columns;
+
+        for (int b = 0; b < 256; ++b) {
+          std::vector<bool> key;
+
+          for (auto& inst : _prog)
+            if (inst.op == CHAR || inst.op == CLASS)
+              key.push_back(inst.op == CHAR ? inst.x == b : _classes[inst.x][b]);
+
+          auto it = columns.insert(std::make_pair(key, static_cast<int>(reps.size())));
+
+          if (it.second)
+            reps.push_back(b);
+          _bytemap[b] = it.first->second;
+        }
+        // Two more columns: a final newline (where $ matches too), and the
+        // end of the text.
+        _nsyms = reps.size() + 2;
+
+        _closure(0, false, seen, restart);
+        set = restart;
+        _start[1] = _dfa_state(set, ids, sets);
+        seen.assign(_prog.size(), false);
+        set.clear();
+        _closure(0, true, seen, set);
+        _start[0] = _dfa_state(set, ids, sets);
+
+        for (size_t s = 0; s < sets.size(); ++s) {
+          if (sets.size() > MAX_DFA_STATES) {
+            _dfa.clear();
+            _accept.clear();
+            return;
+          }
+
+          for (int sym = 0; sym < _nsyms; ++sym) {
+            bool eot = (sym == _nsyms - 1), eol = (sym >= _nsyms - 2);
+            int b = eot ? -1 : eol ? '\n' : reps[sym];
+            std::vector<int> now = sets[s], next;
+
+            // Where $ matches, step past it first. A match found there
+            // stays found, when the final newline is consumed.
+            if (eol)
+              _eol_closure(now);
+            seen.assign(_prog.size(), false);
+            for (auto pc : now) {
+              const Inst& inst = _prog[pc];
+
+              if ((inst.op == CHAR && inst.x == b) || (inst.op == CLASS && !eot && _classes[inst.x][b]))
+                _closure(pc + 1, false, seen, next);
+              else if (inst.op == MATCH && eol)
+                next.push_back(pc);
+            }
+            // Unanchored, a match can start at any position.
+            if (!eot)
+              next.insert(next.end(), restart.begin(), restart.end());
+            int id = _dfa_state(next, ids, sets); // This may grow _dfa
+
+            _dfa[s * _nsyms + sym] = id;
+          }
+        }
+      }
+
+      // Adds what is reachable past the EOLs in set, when $ matches.
+      void
+      _eol_closure(std::vector<int>& set) const
+      {
+        std::vector<bool> seen(_prog.size());
+
+        for (auto pc : set)
+          seen[pc] = true;
+        for (size_t i = 0; i < set.size(); ++i) {
+          if (_prog[set[i]].op == EOL)
+            _closure(set[i] + 1, false, seen, set);
+        }
+      }
+
+      bool
+      _match_dfa(milou::string::StringView s, size_t from) const
+      {
+        int state = _start[from > 0 ? 1 : 0];
+
+        for (size_t i = from; i < s.size(); ++i) {
+          if (_accept[state])
+            return true;
+          if (state == _dead)
+            return false;
+
+          bool final_nl = (i + 1 == s.size() && s[i] == '\n');
+
+          state = _dfa[state * _nsyms + (final_nl ? _nsyms - 2 : _bytemap[static_cast<unsigned char>(s[i])])];
+        }
+        return _accept[state] || _accept[_dfa[state * _nsyms + _nsyms - 1]];
+      }
+
+      // Perl's $, the end of the text or right before a final newline.
+      static bool
+      _at_eol(const char *p, const char *end)
+      {
+        return p == end || (p + 1 == end && *p == '\n');
+      }
+
+      // For short strings, a backtracker is quicker than the Pike VM. It
+      // remembers every (pc, position) it has tried, so it stays linear.
+      struct Job {
+        int pc;
+        const char *p;
+        int slot;               // >= 0 restores caps[slot] to p
+      };
+
+      bool
+      _backtrack(milou::string::StringView s, size_t from, std::vector<const char*>& caps) const
+      {
+        const char *begin = s.data(), *end = begin + s.size(), *base = begin + from;
+        size_t len = s.size() - from + 1; // Nothing before from is visited
+        static thread_local std::vector<uint32_t> visited;
+        static thread_local std::vector<Job> stack;
+
+        visited.assign((_prog.size() * len + 31) / 32, 0);
+        caps.assign(2 * (_groups + 1), NULL);
+
+        for (const char *start = base; start <= end; ++start) {
+          if (_bol && start != begin)
+            break;
+          if (!_prefix.empty() && !_bol) {
+            size_t ix = milou::string::find_substr(milou::string::StringView(start, end - start), _prefix);
+
+            if (ix == milou::string::StringView::npos)
+              break;
+            start += ix;
+          }
+
+          Job first = { 0, start, -1 };
+
+          stack.assign(1, first);
+          while (!stack.empty()) {
+            Job job = stack.back();
+            int pc = job.pc;
+            const char *p = job.p;
+
+            stack.pop_back();
+            if (job.slot >= 0) {
+              caps[job.slot] = p;
+              continue;
+            }
+
+            for (;;) {
+              size_t bit = pc * len + (p - base);
+
+              if (visited[bit / 32] & (1u << (bit % 32)))
+                break;
+              visited[bit / 32] |= 1u << (bit % 32);
+
+              const Inst& inst = _prog[pc];
+
+              if (inst.op == CHAR || inst.op == CLASS) {
+                if (p == end || (inst.op == CHAR ? inst.x != static_cast<unsigned char>(*p)
+                                 : !_classes[inst.x][static_cast<unsigned char>(*p)]))
+                  break;
+                ++pc;
+                ++p;
+              } else if (inst.op == JMP) {
+                pc = inst.x;
+              } else if (inst.op == SPLIT) {
+                Job alt = { inst.y, p, -1 };
+
+                stack.push_back(alt);
+                pc = inst.x;
+              } else if (inst.op == SAVE) {
+                Job restore = { 0, caps[inst.x], inst.x };
+
+                stack.push_back(restore);
+                caps[inst.x] = p;
+                ++pc;
+              } else if (inst.op == BOL || inst.op == EOL) {
+                if (inst.op == BOL ? p != begin : !_at_eol(p, end))
+                  break;
+                ++pc;
+              } else { // MATCH
+                return true;
+              }
+            }
+          }
+        }
+
+        return false;
+      }
+
+      // Pike VM: all threads run in lock step, in priority order, which gives
+      // the same (leftmost, Perl style) captures as a backtracker would.
+      struct Threads {
+        std::vector<int> pcs;
+        std::vector<const char*> caps; // ncaps slots per pc
+        unsigned gen;
+      };
+
+      void
+      _add(Threads& list, std::vector<unsigned>& mark, int pc, const char *p, const char **caps,
+           const char *begin, const char *end) const
+      {
+        if (mark[pc] == list.gen)
+          return;
+        mark[pc] = list.gen;
+
+        const Inst& inst = _prog[pc];
+
+        switch (inst.op) {
+        case JMP:
+          _add(list, mark, inst.x, p, caps, begin, end);
+          break;
+        case SPLIT:
+          _add(list, mark, inst.x, p, caps, begin, end);
+          _add(list, mark, inst.y, p, caps, begin, end);
+          break;
+        case SAVE:
+          {
+            const char *old = caps[inst.x];
+
+            caps[inst.x] = p;
+            _add(list, mark, pc + 1, p, caps, begin, end);
+            caps[inst.x] = old;
+          }
+          break;
+        case BOL:
+          if (p == begin)
+            _add(list, mark, pc + 1, p, caps, begin, end);
+          break;
+        case EOL:
+          if (_at_eol(p, end))
+            _add(list, mark, pc + 1, p, caps, begin, end);
+          break;
+        default:
+          {
+            size_t ncaps = 2 * (_groups + 1);
+
+            list.pcs.push_back(pc);
+            std::copy(caps, caps + ncaps, list.caps.begin() + pc * ncaps);
+          }
+          break;
+        }
+      }
+
+      bool
+      _pike(milou::string::StringView s, size_t from, std::vector<const char*>& caps) const
+      {
+        const char *begin = s.data(), *end = begin + s.size();
+        size_t ncaps = 2 * (_groups + 1);
+        bool matched = false;
+
+        // Per thread scratch space, so a match does not allocate. The marks
+        // stay valid across calls, since the generations keep counting up.
+        static thread_local std::vector<const char*> tmp;
+        static thread_local std::vector<unsigned> mark;
+        static thread_local Threads lists[2];
+        static thread_local unsigned gen = 0;
+
+        if (gen > UINT_MAX - s.size() - 2) {
+          mark.assign(mark.size(), 0);
+          gen = 0;
+        }
+        tmp.resize(ncaps);
+        if (mark.size() < _prog.size())
+          mark.resize(_prog.size(), 0);
+        for (auto& l : lists) {
+          l.pcs.clear();
+          if (l.caps.size() < _prog.size() * ncaps)
+            l.caps.resize(_prog.size() * ncaps);
+        }
+        lists[0].gen = ++gen;
+
+        for (const char *p = begin + from; ; ++p) {
+          Threads& clist = lists[0];
+          Threads& nlist = lists[1];
+
+          if (!matched && (!_bol || p == begin)) {
+            // Nothing in flight, skip ahead to where the literal prefix is.
+            if (clist.pcs.empty() && !_prefix.empty() && !_bol) {
+              size_t ix = milou::string::find_substr(milou::string::StringView(p, end - p), _prefix);
+
+              if (ix == milou::string::StringView::npos)
+                break;
+              p += ix;
+            }
+            std::fill(tmp.begin(), tmp.end(), static_cast<const char*>(NULL));
+            _add(clist, mark, 0, p, &tmp[0], begin, end);
+          }
+          // A thread can die in _add() (e.g. on a $), later ones may still start
+          if (clist.pcs.empty() && (matched || _bol || p == end))
+            break;
+
+          nlist.pcs.clear();
+          nlist.gen = ++gen;
+          for (auto pc : clist.pcs) {
+            const Inst& inst = _prog[pc];
+            const char **tc = &clist.caps[pc * ncaps];
+
+            if (inst.op == MATCH) {
+              matched = true;
+              caps.assign(tc, tc + ncaps);
+              break; // Lower priority threads lose
+            }
+            if (p < end && ((inst.op == CHAR && inst.x == static_cast<unsigned char>(*p)) ||
+                            (inst.op == CLASS && _classes[inst.x][static_cast<unsigned char>(*p)])))
+              _add(nlist, mark, pc + 1, p + 1, tc, begin, end);
+          }
+
+          std::swap(lists[0], lists[1]);
+          if (p == end)
+            break;
+        }
+
+        return matched;
+      }
+
+      bool _good;
+      bool _icase;
+      size_t _groups;
+      bool _literal;
+      bool _bol, _eol;
+      milou::string::String _prefix;
+
+      // Parser state
+      size_t _pos;
+      milou::string::StringView _pattern;
+      std::vector<Node> _nodes;
+
+      std::vector<CharSet> _classes;
+      std::vector<Inst> _prog;
+
+      // DFA, _nsyms transitions per state, empty if it got too big
+      int _bytemap[256];
+      int _nsyms;
+      std::vector<int> _dfa;
+      std::vector<bool> _accept;
+      int _start[2]; // At the start of the string, and elsewhere
+      int _dead = -1; // The empty set, nothing can match from here
+    };
+
+    // Perl's $s =~ /re/
+    inline bool
+    match(milou::string::StringView s, const Regex& re)
+    {
+      return re.match(s);
+    }
+
+    inline bool
+    match(milou::string::StringView s, const Regex& re, Match& m)
+    {
+      return re.match(s, m);
+    }
+
+    // Perl's $s =~ s/re/repl/(g), where repl can refer to captures as $1
+    // or ${1}. Returns the number of substitutions done.
+    inline size_t
+    subst(milou::string::String& s, const Regex& re, milou::string::StringView repl, bool global = false)
+    {
+      milou::string::String out;
+      milou::string::StringView in(s);
+      size_t pos = 0, done = 0;
+      Match m;
+
+      while (pos <= in.size() && re.search(in, pos, m)) {
+        size_t start = m[0].data() - in.data();
+
+        out.append(in.data() + pos, start - pos);
+        for (size_t i = 0; i < repl.size(); ++i) {
+          size_t group = 0, j = i + 1;
+          bool braced = j < repl.size() && repl[j] == '{';
+
+          if (repl[i] != '$' || j + braced >= repl.size() || repl[j + braced] < '0' || repl[j + braced] > '9') {
+            out += repl[i];
+            continue;
+          }
+          for (j += braced; j < repl.size() && repl[j] >= '0' && repl[j] <= '9'; ++j)
+            group = group * 10 + (repl[j] - '0');
+          if (braced && j < repl.size() && repl[j] == '}')
+            ++j;
+          out.append(m[group].data(), m[group].size());
+          i = j - 1;
+        }
+
+        pos = start + m[0].size();
+        ++done;
+        if (m[0].empty()) {
+          // Don't match the same empty string forever.
+          if (pos < in.size())
+            out += in[pos];
+          ++pos;
+        }
+        if (!global)
+          break;
+      }
+
+      if (done) {
+        if (pos < in.size())
+          out.append(in.data() + pos, in.size() - pos);
+        s.swap(out);
+      }
+      return done;
+    }
+
+  } // namespace perl
+} // namespace milou
+
+
+/*
+  local variables:
+  mode: C++
+  indent-tabs-mode: nil
+  c-basic-offset: 2
+  c-comment-only-line-offset: 0
+  c-file-offsets: ((statement-block-intro . +)
+  (label . 0)
+  (statement-cont . +)
+  (innamespace . 0))
+  end:
+*/
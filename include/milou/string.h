@@ -22,15 +22,482 @@
 
 #pragma once
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
 #include <string>
+#include <vector>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_view.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define MILOU_SIMD_X86 1
+# define MILOU_TARGET(t) __attribute__((target(t)))
+# include <immintrin.h>
+#else
+# define MILOU_SIMD_X86 0
+#endif
 
 namespace milou {
   namespace string {
 
     typedef std::string String;
 
+    // A non-owning view into a string, or into a LineReader buffer.
+    typedef boost::string_view StringView;
+    typedef std::vector<StringView> StringViews;
+
     String const NULL_STRING;
+    char const WHITESPACE[] = " \t\n\v\f\r";
+
+    // The locale free string kernels below pick the best instruction set at
+    // run-time. This is detected on first use, and can be lowered (e.g. when
+    // benchmarking), but must never be raised above what the CPU supports.
+    namespace simd {
+      enum Level { SCALAR = 0, SSE42, AVX2 };
+
+      inline Level
+      detect()
+      {
+#if MILOU_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+          return AVX2;
+        if (__builtin_cpu_supports("sse4.2"))
+          return SSE42;
+#endif
+        return SCALAR;
+      }
+
+      inline Level&
+      level()
+      {
+        static Level l = detect();
+        return l;
+      }
+
+      inline const char*
+      name(Level l)
+      {
+        static const char *names[] = { "scalar", "sse4.2", "avx2" };
+        return names[l];
+      }
+
+      // Scan forward (or backward) for the first byte that is (or is not)
+      // in the set. All versions return the index, or StringView::npos.
+      template <bool Reverse, bool Negate>
+      inline size_t
+      scan_scalar(const char *s, size_t n, const char *set, size_t setn)
+      {
+        for (size_t i = 0; i < n; ++i) {
+          size_t ix = Reverse ? n - 1 - i : i;
+
+          if ((memchr(set, s[ix], setn) != NULL) != Negate)
+            return ix;
+        }
+        return StringView::npos;
+      }
+
+      // Same, but the set is given as lo/hi byte pairs, e.g. "az09".
+      inline bool
+      in_ranges(unsigned char c, const char *ranges, size_t rn)
+      {
+        for (size_t i = 0; i + 1 < rn; i += 2)
+          if (c >= static_cast<unsigned char>(ranges[i]) && c <= static_cast<unsigned char>(ranges[i + 1]))
+            return true;
+        return false;
+      }
+
+      inline size_t
+      scan_ranges_scalar(const char *s, size_t n, const char *ranges, size_t rn)
+      {
+        for (size_t i = 0; i < n; ++i)
+          if (!in_ranges(s[i], ranges, rn))
+            return i;
+        return StringView::npos;
+      }
+
+#if MILOU_SIMD_X86
+      template <bool Reverse, bool Negate>
+      MILOU_TARGET("sse4.2") size_t
+      scan_sse42(const char *s, size_t n, const char *set, size_t setn)
+      {
+        char buf[16] = { 0 };
+        size_t i;
+
+        memcpy(buf, set, setn);
+        const __m128i vset = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+
+        for (i = 0; n - i >= 16; i += 16) {
+          const char *p = Reverse ? s + n - i - 16 : s + i;
+          const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+          unsigned mask = _mm_cvtsi128_si32(_mm_cmpestrm(vset, setn, chunk, 16,
+                                                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK));
+
+          if (Negate)
+            mask = ~mask & 0xffff;
+          if (mask)
+            return (p - s) + (Reverse ? 31 - __builtin_clz(mask) : __builtin_ctz(mask));
+        }
+
+        if (Reverse)
+          return scan_scalar<Reverse, Negate>(s, n - i, set, setn);
+
+        size_t ix = scan_scalar<Reverse, Negate>(s + i, n - i, set, setn);
+        return ix == StringView::npos ? ix : ix + i;
+      }
+
+      template <bool Reverse, bool Negate>
+      MILOU_TARGET("avx2") size_t
+      scan_avx2(const char *s, size_t n, const char *set, size_t setn)
+      {
+        __m256i vset[16];
+        size_t i;
+
+        for (i = 0; i < setn; ++i)
+          vset[i] = _mm256_set1_epi8(set[i]);
+
+        for (i = 0; n - i >= 32; i += 32) {
+          const char *p = Reverse ? s + n - i - 32 : s + i;
+          const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+          __m256i eq = _mm256_cmpeq_epi8(chunk, vset[0]);
+
+          for (size_t j = 1; j < setn; ++j)
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(chunk, vset[j]));
+
+          unsigned mask = _mm256_movemask_epi8(eq);
+
+          if (Negate)
+            mask = ~mask;
+          if (mask)
+            return (p - s) + (Reverse ? 31 - __builtin_clz(mask) : __builtin_ctz(mask));
+        }
+
+        if (Reverse)
+          return scan_scalar<Reverse, Negate>(s, n - i, set, setn);
+
+        size_t ix = scan_scalar<Reverse, Negate>(s + i, n - i, set, setn);
+        return ix == StringView::npos ? ix : ix + i;
+      }
+
+      MILOU_TARGET("sse4.2") inline size_t
+      scan_ranges_sse42(const char *s, size_t n, const char *ranges, size_t rn)
+      {
+        char buf[16] = { 0 };
+        size_t i;
+
+        memcpy(buf, ranges, rn);
+        const __m128i vranges = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+
+        for (i = 0; n - i >= 16; i += 16) {
+          const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+          unsigned mask = _mm_cvtsi128_si32(_mm_cmpestrm(vranges, rn, chunk, 16,
+                                                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_BIT_MASK));
+
+          mask = ~mask & 0xffff;
+          if (mask)
+            return i + __builtin_ctz(mask);
+        }
+
+        size_t ix = scan_ranges_scalar(s + i, n - i, ranges, rn);
+        return ix == StringView::npos ? ix : ix + i;
+      }
+
+      MILOU_TARGET("avx2") inline size_t
+      scan_ranges_avx2(const char *s, size_t n, const char *ranges, size_t rn)
+      {
+        __m256i lo[8], hi[8];
+        size_t pairs = rn / 2;
+        size_t i;
+
+        for (i = 0; i < pairs; ++i) {
+          lo[i] = _mm256_set1_epi8(ranges[2 * i]);
+          hi[i] = _mm256_set1_epi8(ranges[2 * i + 1]);
+        }
+
+        for (i = 0; n - i >= 32; i += 32) {
+          const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+          __m256i in = _mm256_setzero_si256();
+
+          // Unsigned lo <= c <= hi, as max(c, lo) == c && min(c, hi) == c
+          for (size_t j = 0; j < pairs; ++j)
+            in = _mm256_or_si256(in, _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(c, lo[j]), c),
+                                                      _mm256_cmpeq_epi8(_mm256_min_epu8(c, hi[j]), c)));
+
+          unsigned mask = ~_mm256_movemask_epi8(in);
+
+          if (mask)
+            return i + __builtin_ctz(mask);
+        }
+
+        size_t ix = scan_ranges_scalar(s + i, n - i, ranges, rn);
+        return ix == StringView::npos ? ix : ix + i;
+      }
+
+      MILOU_TARGET("avx2") inline const char*
+      find_char_avx2(const char *s, size_t n, char c)
+      {
+        const __m256i needle = _mm256_set1_epi8(c);
+
+        for (; n >= 32; s += 32, n -= 32) {
+          unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)), needle));
+
+          if (mask)
+            return s + __builtin_ctz(mask);
+        }
+        return static_cast<const char*>(memchr(s, c, n));
+      }
+
+      MILOU_TARGET("sse4.2") inline void
+      lower_sse42(char *s, size_t n)
+      {
+        // Same as lower_avx2() below, 16 bytes at a time.
+        const __m128i shift = _mm_set1_epi8(128 - 'A');
+        const __m128i limit = _mm_set1_epi8(-128 + 26);
+        const __m128i bit = _mm_set1_epi8(0x20);
+
+        for (; n >= 16; s += 16, n -= 16) {
+          __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+          __m128i upper = _mm_cmpgt_epi8(limit, _mm_add_epi8(c, shift));
+
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(s), _mm_or_si128(c, _mm_and_si128(upper, bit)));
+        }
+        for (; n > 0; ++s, --n)
+          if (*s >= 'A' && *s <= 'Z')
+            *s |= 0x20;
+      }
+
+      MILOU_TARGET("avx2") inline void
+      lower_avx2(char *s, size_t n)
+      {
+        // Shift 'A'..'Z' down to the bottom of the signed range, so one compare finds them.
+        const __m256i shift = _mm256_set1_epi8(128 - 'A');
+        const __m256i limit = _mm256_set1_epi8(-128 + 26);
+        const __m256i bit = _mm256_set1_epi8(0x20);
+
+        for (; n >= 32; s += 32, n -= 32) {
+          __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+          __m256i upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(c, shift));
+
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(s), _mm256_or_si256(c, _mm256_and_si256(upper, bit)));
+        }
+        for (; n > 0; ++s, --n)
+          if (*s >= 'A' && *s <= 'Z')
+            *s |= 0x20;
+      }
+
+      // Filter on the first and last byte of the needle, and only memcmp() the
+      // candidates. The caller handles needles shorter than two bytes.
+      MILOU_TARGET("sse4.2") inline size_t
+      find_substr_sse42(const char *s, size_t n, const char *needle, size_t k)
+      {
+        const __m128i first = _mm_set1_epi8(needle[0]);
+        const __m128i last = _mm_set1_epi8(needle[k - 1]);
+        size_t i;
+
+        for (i = 0; i + k - 1 + 16 <= n; i += 16) {
+          const __m128i bf = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+          const __m128i bl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + k - 1));
+          unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+
+          for (; mask; mask &= mask - 1) {
+            size_t ix = i + __builtin_ctz(mask);
+
+            if (memcmp(s + ix + 1, needle + 1, k - 2) == 0)
+              return ix;
+          }
+        }
+
+        StringView rest(s + i, n - i);
+        size_t ix = rest.find(StringView(needle, k));
+        return ix == StringView::npos ? ix : ix + i;
+      }
+
+      MILOU_TARGET("avx2") inline size_t
+      find_substr_avx2(const char *s, size_t n, const char *needle, size_t k)
+      {
+        const __m256i first = _mm256_set1_epi8(needle[0]);
+        const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+        size_t i;
+
+        for (i = 0; i + k - 1 + 32 <= n; i += 32) {
+          const __m256i bf = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+          const __m256i bl = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + k - 1));
+          unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+
+          for (; mask; mask &= mask - 1) {
+            size_t ix = i + __builtin_ctz(mask);
+
+            if (memcmp(s + ix + 1, needle + 1, k - 2) == 0)
+              return ix;
+          }
+        }
+
+        StringView rest(s + i, n - i);
+        size_t ix = rest.find(StringView(needle, k));
+        return ix == StringView::npos ? ix : ix + i;
+      }
+#endif
+
+      template <bool Reverse, bool Negate>
+      inline size_t
+      scan(const char *s, size_t n, const char *set, size_t setn)
+      {
+        // Trims usually stop at the first byte, don't bother with vectors for that.
+        if (n == 0)
+          return StringView::npos;
+        if ((memchr(set, s[Reverse ? n - 1 : 0], setn) != NULL) != Negate)
+          return Reverse ? n - 1 : 0;
+
+#if MILOU_SIMD_X86
+        if (n >= 16 && setn > 0 && setn <= 16) {
+          switch (level()) {
+          case AVX2:
+            return scan_avx2<Reverse, Negate>(s, n, set, setn);
+          case SSE42:
+            return scan_sse42<Reverse, Negate>(s, n, set, setn);
+          default:
+            break;
+          }
+        }
+#endif
+        return scan_scalar<Reverse, Negate>(s, n, set, setn);
+      }
+    } // namespace simd
+
+    // Find the first occurence of c in the n bytes at s, or NULL. This is
+    // the newline scanner for the LineReader below.
+    inline const char*
+    find_char(const char *s, size_t n, char c)
+    {
+#if MILOU_SIMD_X86
+      if (simd::level() == simd::AVX2)
+        return simd::find_char_avx2(s, n, c);
+#endif
+#if defined(__SSE2__)
+      const __m128i needle = _mm_set1_epi8(c);
+
+      while (n >= 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s)), needle));
+
+        if (mask)
+          return s + __builtin_ctz(mask);
+        s += 16;
+        n -= 16;
+      }
+#endif
+      return static_cast<const char*>(memchr(s, c, n));
+    }
+
+    // Character set searches, these return an index or StringView::npos.
+    inline size_t
+    find_first_of(StringView s, StringView set)
+    {
+      return simd::scan<false, false>(s.data(), s.size(), set.data(), set.size());
+    }
+
+    inline size_t
+    find_first_not_of(StringView s, StringView set)
+    {
+      return simd::scan<false, true>(s.data(), s.size(), set.data(), set.size());
+    }
+
+    inline size_t
+    find_last_of(StringView s, StringView set)
+    {
+      return simd::scan<true, false>(s.data(), s.size(), set.data(), set.size());
+    }
+
+    inline size_t
+    find_last_not_of(StringView s, StringView set)
+    {
+      return simd::scan<true, true>(s.data(), s.size(), set.data(), set.size());
+    }
+
+    // Find the first byte that is outside all of the ranges, which are given
+    // as lo/hi pairs (e.g. "az09" for lower case alpha-numerics).
+    inline size_t
+    find_first_not_in(StringView s, StringView ranges)
+    {
+#if MILOU_SIMD_X86
+      if (s.size() >= 16 && ranges.size() <= 16) {
+        switch (simd::level()) {
+        case simd::AVX2:
+          return simd::scan_ranges_avx2(s.data(), s.size(), ranges.data(), ranges.size());
+        case simd::SSE42:
+          return simd::scan_ranges_sse42(s.data(), s.size(), ranges.data(), ranges.size());
+        default:
+          break;
+        }
+      }
+#endif
+      return simd::scan_ranges_scalar(s.data(), s.size(), ranges.data(), ranges.size());
+    }
+
+    // Find a substring, returns the index or StringView::npos.
+    inline size_t
+    find_substr(StringView s, StringView needle)
+    {
+      if (needle.size() < 2) {
+        if (needle.empty())
+          return 0;
+
+        const char *p = find_char(s.data(), s.size(), needle[0]);
+        return p ? p - s.data() : StringView::npos;
+      }
+
+#if MILOU_SIMD_X86
+      switch (simd::level()) {
+      case simd::AVX2:
+        return simd::find_substr_avx2(s.data(), s.size(), needle.data(), needle.size());
+      case simd::SSE42:
+        return simd::find_substr_sse42(s.data(), s.size(), needle.data(), needle.size());
+      default:
+        break;
+      }
+#endif
+      return s.find(needle);
+    }
+
+    // ASCII only lower casing, in place. Use boost::algorithm::to_lower()
+    // if you need the locale.
+    inline void
+    lower(char *s, size_t n)
+    {
+#if MILOU_SIMD_X86
+      switch (simd::level()) {
+      case simd::AVX2:
+        return simd::lower_avx2(s, n);
+      case simd::SSE42:
+        return simd::lower_sse42(s, n);
+      default:
+        break;
+      }
+#endif
+      for (; n > 0; ++s, --n)
+        if (*s >= 'A' && *s <= 'Z')
+          *s |= 0x20;
+    }
+
+    inline void
+    lower(String& s)
+    {
+      lower(&s[0], s.size());
+    }
+
+    // Perl'ish lc(), returns a lower cased copy.
+    inline String
+    lc(StringView s)
+    {
+      String str(s.data(), s.size());
+
+      lower(str);
+      return str;
+    }
 
     // Trim any trailing \r\n.
     template<typename T>
@@ -40,6 +507,219 @@ namespace milou {
       boost::algorithm::trim_right_if(input, boost::is_any_of("\r\n"));
     }
 
+    inline void
+    chomp(String& input)
+    {
+      input.resize(find_last_not_of(input, "\r\n") + 1); // npos + 1 == 0
+    }
+
+    // Zero-copy versions of chomp() and trim(), these just shrink the view.
+    inline void
+    chomp(StringView& input)
+    {
+      input = input.substr(0, find_last_not_of(input, "\r\n") + 1);
+    }
+
+    inline void
+    trim(StringView& input)
+    {
+      size_t last = find_last_not_of(input, WHITESPACE);
+
+      if (last == StringView::npos) {
+        input.clear();
+      } else {
+        size_t first = find_first_not_of(input, WHITESPACE);
+
+        input = input.substr(first, last + 1 - first);
+      }
+    }
+
+    // Locale free replacement for boost::algorithm::trim(), for ASCII white space.
+    inline void
+    trim(String& input)
+    {
+      size_t last = find_last_not_of(input, WHITESPACE);
+
+      if (last == StringView::npos) {
+        input.clear();
+      } else {
+        input.resize(last + 1);
+        input.erase(0, find_first_not_of(input, WHITESPACE));
+      }
+    }
+
+    // Split on any of the characters in set, calling f(field) for each field.
+    // Empty fields are kept, same as boost::algorithm::split().
+    template <typename F>
+    inline void
+    split_each(StringView s, StringView set, F f)
+    {
+      for (;;) {
+        size_t ix;
+
+        if (set.size() == 1) {
+          const char *p = find_char(s.data(), s.size(), set[0]);
+
+          ix = p ? p - s.data() : StringView::npos;
+        } else {
+          ix = find_first_of(s, set);
+        }
+
+        if (ix == StringView::npos) {
+          f(s);
+          return;
+        }
+        f(s.substr(0, ix));
+        s.remove_prefix(ix + 1);
+      }
+    }
+
+    inline StringViews
+    split(StringView s, StringView set)
+    {
+      StringViews fields;
+
+      split_each(s, set, [&fields](StringView f) { fields.push_back(f); });
+      return fields;
+    }
+
+    // Read lines from a file, or STDIN, without copying them. Regular files
+    // are memory mapped, anything else is read in large blocks. The returned
+    // views do not include the newline, and are valid until the next call to
+    // getline() (for mapped files, until the reader is destroyed).
+    class LineReader {
+    public:
+      LineReader()
+        : _fd(STDIN_FILENO), _own(false)
+      {
+        _open();
+      }
+
+      // A NULL path, or "-", reads STDIN.
+      explicit LineReader(const char *path)
+        : _fd(STDIN_FILENO), _own(false)
+      {
+        if (path && strcmp(path, "-") != 0) {
+          _fd = ::open(path, O_RDONLY);
+          _own = true;
+        }
+        _open();
+      }
+
+      LineReader(const LineReader&) = delete;
+      LineReader& operator=(const LineReader&) = delete;
+
+      ~LineReader()
+      {
+        if (_map)
+          munmap(const_cast<char*>(_map), _end);
+        if (_own && _fd >= 0)
+          ::close(_fd);
+      }
+
+      bool good() const { return _fd >= 0; }
+
+      bool
+      getline(StringView& line)
+      {
+        if (!good())
+          return false;
+
+        for (;;) {
+          const char *start = _data + _pos;
+          const char *nl = find_char(_data + _scan, _end - _scan, '\n');
+
+          if (nl) {
+            line = StringView(start, nl - start);
+            _pos = _scan = nl - _data + 1;
+            return true;
+          }
+
+          _scan = _end;
+          if (_map || _eof || !_fill()) {
+            if (_pos < _end) {  // Last line, without a trailing newline
+              line = StringView(start, _end - _pos);
+              _pos = _scan = _end;
+              return true;
+            }
+            return false;
+          }
+        }
+      }
+
+    private:
+      static const size_t BLOCK_SIZE = 1024 * 1024;
+
+      void
+      _open()
+      {
+        struct stat st;
+
+        if (_fd < 0)
+          return;
+
+        if (fstat(_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+          void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+
+          if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            _data = _map = static_cast<const char*>(map);
+            _end = st.st_size;
+            return;
+          }
+        }
+
+        _buf.resize(BLOCK_SIZE);
+        _data = _buf.data();
+      }
+
+      // Read another block, keeping the partial line we have so far.
+      bool
+      _fill()
+      {
+        size_t partial = _end - _pos;
+        ssize_t n;
+
+        if (_pos > 0) {
+          memmove(&_buf[0], &_buf[_pos], partial);
+          _scan -= _pos;
+          _end = partial;
+          _pos = 0;
+        }
+        if (_end == _buf.size())
+          _buf.resize(_buf.size() * 2);
+        _data = _buf.data();
+
+        do {
+          n = ::read(_fd, &_buf[_end], _buf.size() - _end);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0) {
+          _eof = true;
+          return false;
+        }
+        _end += n;
+        return true;
+      }
+
+      int _fd;
+      bool _own;
+      bool _eof = false;
+      const char *_map = NULL;
+      const char *_data = NULL;
+      size_t _pos = 0;
+      size_t _scan = 0;
+      size_t _end = 0;
+      std::vector<char> _buf;
+    };
+
+    // Perl'ish: while (getline(in, line)) { ... }
+    inline bool
+    getline(LineReader& reader, StringView& line)
+    {
+      return reader.getline(line);
+    }
+
     // Convenience for getting the size of a string.
     size_t size(String& s) { return s.size(); }
     size_t size(const String& s) { return s.size(); }
@@ -47,6 +727,8 @@ namespace milou {
     size_t size(String *s) { return s->size(); }
     size_t size(const String *s) { return s->size(); }
 
+    inline size_t size(const StringView& s) { return s.size(); }
+
   } // namespace string
 } // namespace milou
 
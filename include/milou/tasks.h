@@ -0,0 +1,229 @@
+/** @file
+
+    A small work-stealing task scheduler, for fork / join style parallelism.
+
+    @section license License
+
+    Licensed to the Apache Software Foundation (ASF) under one or more
+    contributor license agreements.  See the NOTICE file distributed with
+    this work for additional information regarding copyright ownership.  The
+    ASF licenses this file to you under the Apache License, Version 2.0 (the
+    "License"); you may not use this file except in compliance with the
+    License.  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace milou {
+  namespace tasks {
+
+    typedef std::function<void ()> Task;
+
+    // Each worker thread has its own deque of tasks. A worker pushes and pops
+    // its own tasks at the back (newest first, which keeps the data warm),
+    // and when it runs dry it steals the oldest task from another worker.
+    class Scheduler {
+    public:
+      explicit Scheduler(unsigned threads = 0)
+        : _stop(false), _queued(0), _next(0)
+      {
+        if (threads == 0)
+          threads = std::max(1u, std::thread::hardware_concurrency());
+
+        _size = threads;
+        _queues.reset(new Queue[_size]);
+        for (unsigned i = 0; i < _size; ++i)
+          _threads.emplace_back([this, i]() { _worker(i); });
+      }
+
+      Scheduler(const Scheduler&) = delete;
+      Scheduler& operator=(const Scheduler&) = delete;
+
+      ~Scheduler()
+      {
+        {
+          std::lock_guard<std::mutex> l(_lock);
+          _stop = true;
+        }
+        _cv.notify_all();
+        for (auto& t : _threads)
+          t.join();
+      }
+
+      // The shared, default scheduler, with one thread per core.
+      static Scheduler&
+      instance()
+      {
+        static Scheduler sched;
+        return sched;
+      }
+
+      unsigned size() const { return _size; }
+
+      void
+      submit(Task t)
+      {
+        int self = _self();
+        unsigned q = self >= 0 ? self : _next++ % _size;
+
+        {
+          std::lock_guard<std::mutex> l(_queues[q].lock);
+          _queues[q].tasks.push_back(std::move(t));
+        }
+        ++_queued;
+        {
+          std::lock_guard<std::mutex> l(_lock);
+        }
+        _cv.notify_one();
+      }
+
+      // Run one task, if there is one. This is also how threads waiting on a
+      // TaskGroup help out, instead of blocking.
+      bool
+      run_one()
+      {
+        int self = _self();
+        unsigned start = self >= 0 ? self : 0;
+        Task t;
+
+        for (unsigned i = 0; i < _size && !t; ++i) {
+          Queue& q = _queues[(start + i) % _size];
+          std::lock_guard<std::mutex> l(q.lock);
+
+          if (q.tasks.empty())
+            continue;
+          if (i == 0 && self >= 0) {
+            t = std::move(q.tasks.back());
+            q.tasks.pop_back();
+          } else {
+            t = std::move(q.tasks.front());
+            q.tasks.pop_front();
+          }
+        }
+
+        if (!t)
+          return false;
+
+        --_queued;
+        t();
+        return true;
+      }
+
+    private:
+      struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+      };
+
+      // Our worker index, or -1 if the calling thread is not one of ours.
+      int
+      _self() const
+      {
+        return _owner() == this ? _index() : -1;
+      }
+
+      static const Scheduler*& _owner() { static thread_local const Scheduler *owner = NULL; return owner; }
+      static int& _index() { static thread_local int index = -1; return index; }
+
+      void
+      _worker(unsigned i)
+      {
+        _owner() = this;
+        _index() = i;
+
+        while (1) {
+          if (run_one())
+            continue;
+
+          std::unique_lock<std::mutex> l(_lock);
+
+          _cv.wait(l, [this]() { return _stop || _queued > 0; });
+          if (_stop)
+            return;
+        }
+      }
+
+      unsigned _size;
+      std::unique_ptr<Queue[]> _queues;
+      std::vector<std::thread> _threads;
+      std::mutex _lock;
+      std::condition_variable _cv;
+      bool _stop;
+      std::atomic<size_t> _queued;
+      std::atomic<unsigned> _next;
+    };
+
+    // Fork / join: run() any number of tasks, and wait() for all of them. The
+    // waiting thread runs tasks itself, so groups can be nested freely.
+    class TaskGroup {
+    public:
+      explicit TaskGroup(Scheduler& sched = Scheduler::instance())
+        : _sched(sched), _pending(0)
+      { }
+
+      TaskGroup(const TaskGroup&) = delete;
+      TaskGroup& operator=(const TaskGroup&) = delete;
+
+      ~TaskGroup() { wait(); }
+
+      Scheduler& scheduler() const { return _sched; }
+
+      template <typename F>
+      void
+      run(F f)
+      {
+        ++_pending;
+        _sched.submit([this, f]() {
+            f();
+            --_pending;
+          });
+      }
+
+      void
+      wait()
+      {
+        while (_pending > 0) {
+          if (!_sched.run_one())
+            std::this_thread::yield();
+        }
+      }
+
+    private:
+      Scheduler& _sched;
+      std::atomic<size_t> _pending;
+    };
+
+  } // namespace tasks
+} // namespace milou
+
+
+/*
+  local variables:
+  mode: C++
+  indent-tabs-mode: nil
+  c-basic-offset: 2
+  c-comment-only-line-offset: 0
+  c-file-offsets: ((statement-block-intro . +)
+  (label . 0)
+  (statement-cont . +)
+  (innamespace . 0))
+  end:
+*/